@@ -13,13 +13,29 @@ TEMPLATE = app
 
 SOURCES += main.cpp\
         mainwindow.cpp \
+    avirtuning.cpp \
     filters.cpp \
+    pipeline.cpp \
+    simd.cpp \
+    threadpool.cpp \
     Helpers/Angle.cpp
 
 HEADERS  += mainwindow.h \
+    avirtuning.h \
     filters.h \
+    pipeline.h \
     avir.h \
+    avir_float4_sse.h \
+    simd.h \
+    threadpool.h \
     Helpers/Angle.h \
     Helpers/Math.h
 
 FORMS    += mainwindow.ui
+
+# Debug builds add --self-test, which checks the optimized kernels against their references
+CONFIG(debug, debug|release) {
+    DEFINES += SP_SELF_TEST
+    SOURCES += dpidselftest.cpp
+    HEADERS += dpidselftest.h
+}
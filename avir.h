@@ -275,6 +275,104 @@ inline T convertLin2SRGB( const T s )
 	return(( (T) 1 + a ) * pow24i_sRGB( s ) - a );
 }
 
+/**
+ * @brief sRGB gamma correction tables.
+ *
+ * This class holds lookup tables that speed up sRGB gamma correction: an
+ * exact linearization table for 8-bit input values, and a linearly
+ * interpolated de-linearization table for the 0 to 1 range. The tables are
+ * built on first use, and shared by all resizer objects using the same "T"
+ * type.
+ *
+ * @tparam T Floating-point type of table entries.
+ */
+
+template< class T >
+class CSRGBGammaTables
+{
+public:
+	static const int Lin2SRGBTableSize = 4096; ///< The number of intervals
+		///< in the de-linearization table.
+		///<
+
+	/**
+	 * @return The 8-bit value multiplier the linearization table was built
+	 * for.
+	 */
+
+	static T getSRGB2LinMult()
+	{
+		return( (T) ( 1.0 / 255.0 ));
+	}
+
+	/**
+	 * Function returns the linearization table: its entry "i" equals to
+	 * convertSRGB2Lin( (T) i * getSRGB2LinMult() ).
+	 */
+
+	static const T* getSRGB2Lin8()
+	{
+		return( getInstance().SRGB2Lin8 );
+	}
+
+	/**
+	 * Function de-linearizes the linear gamma value using a table. In the 0
+	 * to 1 range the result differs from the convertLin2SRGB() function by
+	 * less than 2e-5, outside of this range the function is evaluated
+	 * directly.
+	 *
+	 * @param s Linear gamma value.
+	 * @return sRGB gamma value.
+	 */
+
+	static T convertLin2SRGB( const T s )
+	{
+		if( s <= (T) 0.0031308 )
+		{
+			return( (T) 12.92 * s );
+		}
+
+		if( s >= (T) 1 )
+		{
+			return( avir :: convertLin2SRGB( s ));
+		}
+
+		const T* const Table = getInstance().Lin2SRGB;
+		const T x = s * (T) Lin2SRGBTableSize;
+		const int i = (int) x;
+
+		return( Table[ i ] + ( Table[ i + 1 ] - Table[ i ]) * ( x - (T) i ));
+	}
+
+private:
+	T SRGB2Lin8[ 256 ]; ///< Linearization table for 8-bit values.
+		///<
+	T Lin2SRGB[ Lin2SRGBTableSize + 1 ]; ///< De-linearization table.
+		///<
+
+	CSRGBGammaTables()
+	{
+		int i;
+
+		for( i = 0; i < 256; i++ )
+		{
+			SRGB2Lin8[ i ] = convertSRGB2Lin( (T) i * getSRGB2LinMult() );
+		}
+
+		for( i = 0; i <= Lin2SRGBTableSize; i++ )
+		{
+			Lin2SRGB[ i ] = avir :: convertLin2SRGB(
+				(T) ( (double) i / Lin2SRGBTableSize ));
+		}
+	}
+
+	static const CSRGBGammaTables& getInstance()
+	{
+		static const CSRGBGammaTables Instance;
+		return( Instance );
+	}
+};
+
 /**
  * Function converts (via typecast) specified array of type T1 values of
  * length l into array of type T2 values. If T1 is the same as T2, copy
@@ -2427,6 +2525,11 @@ public:
 	double oy; ///< Start Y pixel offset within source image (can be
 		///< negative). Positive offset moves image to the top.
 		///<
+	int ElIncrIO; ///< The number of source and destination image's elements
+		///< between adjacent pixels. Set to 0 to use ElCountIO. A larger
+		///< value skips unused elements, e.g. the 4th byte of 3-channel
+		///< 32-bit pixels; skipped destination elements are left unchanged.
+		///<
 	CImageResizerThreadPool* ThreadPool; ///< Thread pool to be used by the
 		///< image resizing function. Set to NULL to use single-threaded
 		///< processing.
@@ -2445,6 +2548,7 @@ public:
 	CImageResizerVars()
 		: ox( 0.0 )
 		, oy( 0.0 )
+		, ElIncrIO( 0 )
 		, ThreadPool( NULL )
 		, UseSRGBGamma( false )
 		, BuildMode( -1 )
@@ -2702,6 +2806,7 @@ public:
 	{
 		const int ElCount = Vars -> ElCount;
 		const int ElCountIO = Vars -> ElCountIO;
+		const int ElIncrIO = Vars -> ElIncrIO;
 		fptype* op = op0;
 		int l = l0;
 
@@ -2714,7 +2819,7 @@ public:
 					fptypeatom* v = (fptypeatom*) op;
 					v[ 0 ] = (fptypeatom) ip[ 0 ];
 					op += ElCount;
-					ip++;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2729,7 +2834,7 @@ public:
 					v[ 2 ] = (fptypeatom) ip[ 2 ];
 					v[ 3 ] = (fptypeatom) ip[ 3 ];
 					op += ElCount;
-					ip += 4;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2743,7 +2848,7 @@ public:
 					v[ 1 ] = (fptypeatom) ip[ 1 ];
 					v[ 2 ] = (fptypeatom) ip[ 2 ];
 					op += ElCount;
-					ip += 3;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2756,7 +2861,70 @@ public:
 					v[ 0 ] = (fptypeatom) ip[ 0 ];
 					v[ 1 ] = (fptypeatom) ip[ 1 ];
 					op += ElCount;
-					ip += 2;
+					ip += ElIncrIO;
+					l--;
+				}
+			}
+		}
+		else
+		if( sizeof( Tin ) == 1 && (fptypeatom) Vars -> InGammaMult ==
+			CSRGBGammaTables< fptypeatom > :: getSRGB2LinMult() )
+		{
+			// 8-bit input: use the linearization table.
+
+			const fptypeatom* const lt =
+				CSRGBGammaTables< fptypeatom > :: getSRGB2Lin8();
+
+			if( ElCountIO == 1 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) op;
+					v[ 0 ] = lt[ (uint8_t) ip[ 0 ]];
+					op += ElCount;
+					ip += ElIncrIO;
+					l--;
+				}
+			}
+			else
+			if( ElCountIO == 4 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) op;
+					v[ 0 ] = lt[ (uint8_t) ip[ 0 ]];
+					v[ 1 ] = lt[ (uint8_t) ip[ 1 ]];
+					v[ 2 ] = lt[ (uint8_t) ip[ 2 ]];
+					v[ 3 ] = lt[ (uint8_t) ip[ 3 ]];
+					op += ElCount;
+					ip += ElIncrIO;
+					l--;
+				}
+			}
+			else
+			if( ElCountIO == 3 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) op;
+					v[ 0 ] = lt[ (uint8_t) ip[ 0 ]];
+					v[ 1 ] = lt[ (uint8_t) ip[ 1 ]];
+					v[ 2 ] = lt[ (uint8_t) ip[ 2 ]];
+					op += ElCount;
+					ip += ElIncrIO;
+					l--;
+				}
+			}
+			else
+			if( ElCountIO == 2 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) op;
+					v[ 0 ] = lt[ (uint8_t) ip[ 0 ]];
+					v[ 1 ] = lt[ (uint8_t) ip[ 1 ]];
+					op += ElCount;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2772,7 +2940,7 @@ public:
 					fptypeatom* v = (fptypeatom*) op;
 					v[ 0 ] = convertSRGB2Lin( (fptypeatom) ip[ 0 ] * gm );
 					op += ElCount;
-					ip++;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2787,7 +2955,7 @@ public:
 					v[ 2 ] = convertSRGB2Lin( (fptypeatom) ip[ 2 ] * gm );
 					v[ 3 ] = convertSRGB2Lin( (fptypeatom) ip[ 3 ] * gm );
 					op += ElCount;
-					ip += 4;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2801,7 +2969,7 @@ public:
 					v[ 1 ] = convertSRGB2Lin( (fptypeatom) ip[ 1 ] * gm );
 					v[ 2 ] = convertSRGB2Lin( (fptypeatom) ip[ 2 ] * gm );
 					op += ElCount;
-					ip += 3;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2814,7 +2982,7 @@ public:
 					v[ 0 ] = convertSRGB2Lin( (fptypeatom) ip[ 0 ] * gm );
 					v[ 1 ] = convertSRGB2Lin( (fptypeatom) ip[ 1 ] * gm );
 					op += ElCount;
-					ip += 2;
+					ip += ElIncrIO;
 					l--;
 				}
 			}
@@ -2877,6 +3045,64 @@ public:
 		const int ElCountIO = Vars0.ElCountIO;
 		const fptypeatom gm = (fptypeatom) Vars0.OutGammaMult;
 
+		if( gm == (fptypeatom) 255.0 )
+		{
+			// 8-bit output: use the de-linearization table, its error is
+			// well below the output's precision.
+
+			typedef CSRGBGammaTables< fptypeatom > Tables;
+
+			if( ElCountIO == 1 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) p;
+					v[ 0 ] = Tables :: convertLin2SRGB( v[ 0 ]) * gm;
+					p += ElCount;
+					l--;
+				}
+			}
+			else
+			if( ElCountIO == 4 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) p;
+					v[ 0 ] = Tables :: convertLin2SRGB( v[ 0 ]) * gm;
+					v[ 1 ] = Tables :: convertLin2SRGB( v[ 1 ]) * gm;
+					v[ 2 ] = Tables :: convertLin2SRGB( v[ 2 ]) * gm;
+					v[ 3 ] = Tables :: convertLin2SRGB( v[ 3 ]) * gm;
+					p += ElCount;
+					l--;
+				}
+			}
+			else
+			if( ElCountIO == 3 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) p;
+					v[ 0 ] = Tables :: convertLin2SRGB( v[ 0 ]) * gm;
+					v[ 1 ] = Tables :: convertLin2SRGB( v[ 1 ]) * gm;
+					v[ 2 ] = Tables :: convertLin2SRGB( v[ 2 ]) * gm;
+					p += ElCount;
+					l--;
+				}
+			}
+			else
+			if( ElCountIO == 2 )
+			{
+				while( l > 0 )
+				{
+					fptypeatom* v = (fptypeatom*) p;
+					v[ 0 ] = Tables :: convertLin2SRGB( v[ 0 ]) * gm;
+					v[ 1 ] = Tables :: convertLin2SRGB( v[ 1 ]) * gm;
+					p += ElCount;
+					l--;
+				}
+			}
+		}
+		else
 		if( ElCountIO == 1 )
 		{
 			while( l > 0 )
@@ -3015,6 +3241,7 @@ public:
 	{
 		const int ElCount = Vars0.ElCount;
 		const int ElCountIO = Vars0.ElCountIO;
+		const int ElIncrIO = Vars0.ElIncrIO;
 
 		if( ElCountIO == 1 )
 		{
@@ -3023,7 +3250,7 @@ public:
 				const fptypeatom* v = (const fptypeatom*) ip;
 				op[ 0 ] = (Tout) v[ 0 ];
 				ip += ElCount;
-				op++;
+				op += ElIncrIO;
 				l--;
 			}
 		}
@@ -3038,7 +3265,7 @@ public:
 				op[ 2 ] = (Tout) v[ 2 ];
 				op[ 3 ] = (Tout) v[ 3 ];
 				ip += ElCount;
-				op += 4;
+				op += ElIncrIO;
 				l--;
 			}
 		}
@@ -3052,7 +3279,7 @@ public:
 				op[ 1 ] = (Tout) v[ 1 ];
 				op[ 2 ] = (Tout) v[ 2 ];
 				ip += ElCount;
-				op += 3;
+				op += ElIncrIO;
 				l--;
 			}
 		}
@@ -3065,7 +3292,7 @@ public:
 				op[ 0 ] = (Tout) v[ 0 ];
 				op[ 1 ] = (Tout) v[ 1 ];
 				ip += ElCount;
-				op += 2;
+				op += ElIncrIO;
 				l--;
 			}
 		}
@@ -4277,6 +4504,8 @@ template< class fpclass = fpclass_def< float > >
 class CImageResizer
 {
 public:
+	class CPlan;
+
 	/**
 	 * Constructor initializes the resizer.
 	 *
@@ -4305,6 +4534,16 @@ public:
 		FixedFilterBank.createAllFilters();
 	}
 
+	/**
+	 * @return The number of build modes available to this resizer: valid
+	 * CImageResizerVars::BuildMode values are 0 to this count minus one.
+	 */
+
+	int getBuildModeCount() const
+	{
+		return( FixedFilterBank.getOrder() == 0 ? 4 : 2 );
+	}
+
 	/**
 	 * Function resizes image.
 	 *
@@ -4312,7 +4551,7 @@ public:
 	 * @param SrcWidth Source image width.
 	 * @param SrcHeight Source image height.
 	 * @param SrcScanlineSize Physical size of source scanline in elements. If
-	 * this value is below 1, SrcWidth * ElCountIO will be used as the
+	 * this value is below 1, SrcWidth * ElIncrIO will be used as the
 	 * physical source scanline size.
 	 * @param[out] NewBuf Buffer to accept the resized image. Can be equal to
 	 * SrcBuf if the size of the resized image is smaller or equal to source
@@ -4334,6 +4573,11 @@ public:
 	 * this function. The access to this object is not thread-safe, each
 	 * concurrent instance of this function should use a separate aVars
 	 * object.
+	 * @param[in,out] aPlan Pointer to a resizing plan object. Can be NULL.
+	 * If the plan was built by a previous call with the same image sizes,
+	 * "k" and input variables, its filtering steps and intermediate buffers
+	 * are reused; otherwise the plan is rebuilt. The plan object should not
+	 * be shared by concurrent calls.
 	 * @tparam Tin Input buffer element's type. Can be uint8_t (0-255 value
 	 * range), uint16_t (0-65535 value range), float (0.0-1.0 value range),
 	 * double (0.0-1.0 value range). Larger integer types are treated as
@@ -4348,7 +4592,8 @@ public:
 	void resizeImage( const Tin* const SrcBuf, const int SrcWidth,
 		const int SrcHeight, int SrcScanlineSize, Tout* const NewBuf,
 		const int NewWidth, const int NewHeight, const int ElCountIO,
-		const double k, CImageResizerVars* const aVars = NULL ) const
+		const double k, CImageResizerVars* const aVars = NULL,
+		CPlan* const aPlan = NULL ) const
 	{
 		if( SrcWidth == 0 || SrcHeight == 0 )
 		{
@@ -4364,17 +4609,247 @@ public:
 		CImageResizerVars DefVars;
 		CImageResizerVars& Vars = ( aVars == NULL ? DefVars : *aVars );
 
-		CImageResizerThreadPool DefThreadPool;
-		CImageResizerThreadPool& ThreadPool = ( Vars.ThreadPool == NULL ?
-			DefThreadPool : *Vars.ThreadPool );
+		CPlan DefPlan;
+		CPlan& Plan = ( aPlan == NULL ? DefPlan : *aPlan );
+
+		double kx;
+		double ky;
+		double ox;
+		double oy;
+		calcResizeSteps( SrcWidth, SrcHeight, NewWidth, NewHeight, k, Vars,
+			kx, ky, ox, oy );
+
+		doResizeImage( SrcBuf, SrcWidth, SrcHeight, SrcScanlineSize, NewBuf,
+			NewWidth, NewHeight, ElCountIO, kx, ky, ox, oy, Vars.BuildMode,
+			Vars.BuildMode, Vars, Plan );
+	}
+
+	/**
+	 * Function resizes image in horizontal strips, with bounded memory use.
+	 * This function produces the same result as the resizeImage() function,
+	 * but instead of filtering the whole image at once, it processes
+	 * "StripHeight" rows of the resulting image at a time, together with the
+	 * source rows these output rows depend on. The intermediate buffers then
+	 * scale with the image width and the filter length, not with the image
+	 * height. Useful for very large images.
+	 *
+	 * Strips are filtered with the same filters and source row alignment as
+	 * the whole image, and are extended by the rows the correction filter
+	 * needs, so the result is the same as produced by resizeImage(), up to
+	 * the rounding of resizing positions. If the ditherer is recursive, its
+	 * error diffusion restarts on each strip.
+	 *
+	 * See the resizeImage() function for the description of other
+	 * parameters. Unlike resizeImage(), this function does not support
+	 * in-place resizing: NewBuf should not overlap SrcBuf.
+	 *
+	 * @param StripHeight The number of resulting image rows produced at a
+	 * time. Rounded up so that each strip begins at the same fractional
+	 * source position, if that does not make the strip too high; this lets
+	 * the strips share the plan's filtering steps.
+	 */
+
+	template< class Tin, class Tout >
+	void resizeImageStrips( const Tin* const SrcBuf, const int SrcWidth,
+		const int SrcHeight, int SrcScanlineSize, Tout* const NewBuf,
+		const int NewWidth, const int NewHeight, const int ElCountIO,
+		const double k, int StripHeight, CImageResizerVars* const aVars = NULL,
+		CPlan* const aPlan = NULL ) const
+	{
+		if( SrcWidth == 0 || SrcHeight == 0 )
+		{
+			memset( NewBuf, 0, NewWidth * NewHeight * sizeof( Tout ));
+			return;
+		}
+		else
+		if( NewWidth == 0 || NewHeight == 0 )
+		{
+			return;
+		}
+
+		CImageResizerVars DefVars;
+		CImageResizerVars& Vars = ( aVars == NULL ? DefVars : *aVars );
 
-		// Define resizing steps, also optionally modify offsets so that
-		// resizing produces a "centered" image.
+		CPlan DefPlan;
+		CPlan& Plan = ( aPlan == NULL ? DefPlan : *aPlan );
 
 		double kx;
 		double ky;
-		double ox = Vars.ox;
-		double oy = Vars.oy;
+		double ox;
+		double oy;
+		calcResizeSteps( SrcWidth, SrcHeight, NewWidth, NewHeight, k, Vars,
+			kx, ky, ox, oy );
+
+		const int ElIncrIO = getElIncrIO( Vars, ElCountIO );
+
+		if( SrcScanlineSize < 1 )
+		{
+			SrcScanlineSize = SrcWidth * ElIncrIO;
+		}
+
+		if( StripHeight < 1 )
+		{
+			StripHeight = 1;
+		}
+
+		if( StripHeight >= NewHeight )
+		{
+			doResizeImage( SrcBuf, SrcWidth, SrcHeight, SrcScanlineSize,
+				NewBuf, NewWidth, NewHeight, ElCountIO, kx, ky, ox, oy,
+				Vars.BuildMode, Vars.BuildMode, Vars, Plan );
+
+			return;
+		}
+
+		// The plan describes the whole image: its filtering steps give the
+		// build modes all strips should use, and the vertical downsampling
+		// factor strip starts should be aligned to, so that the strips
+		// filter the same source rows with the same filters. Its buffers are
+		// never allocated, the strips are filtered with its strip plans.
+
+		const bool IsInFloat = ( (Tin) 0.4 != 0 );
+		const bool IsOutFloat = ( (Tout) 0.4 != 0 );
+
+		if( !Plan.isBuiltFor( SrcWidth, SrcHeight, NewWidth, NewHeight,
+			ElCountIO, kx, ky, ox, oy, Vars.BuildMode, Vars.BuildMode, Vars,
+			IsInFloat, sizeof( Tin ), IsOutFloat, sizeof( Tout )))
+		{
+			Plan.clear();
+			buildPlan( Plan, SrcWidth, SrcHeight, NewWidth, NewHeight,
+				ElCountIO, kx, ky, ox, oy, Vars.BuildMode, Vars.BuildMode,
+				Vars, IsInFloat, sizeof( Tin ), IsOutFloat, sizeof( Tout ));
+		}
+		else
+		{
+			Plan.HitCount++;
+		}
+
+		const int ModeH = Plan.UsedBuildModeH;
+		const int ModeV = Plan.UsedBuildModeV;
+		const int Align = Plan.DecimationV;
+
+		if( Plan.StripPlans.getItemCount() < 3 )
+		{
+			Plan.StripPlans.setItemCount( 3 );
+		}
+
+		// Source rows needed on each side of a strip, covering the support
+		// of the low-pass, interpolation and correction filters. The
+		// correction filter works on the resulting rows, so each strip is
+		// also extended by the resulting rows it needs, and these are then
+		// discarded.
+
+		const double kf = ( ky > 1.0 ? ky : 1.0 );
+		const int Margin = (int) ceil( kf * ( Params.LPFltBaseLen +
+			Params.IntFltLen + Params.CorrFltLen )) + Align;
+
+		const int NewMargin = (int) ceil( Params.CorrFltLen ) + 1;
+
+		// Make the strips start at the same fractional source position if
+		// possible, so that all inner strips can share the plan.
+
+		if( k == 0.0 && NewHeight < SrcHeight )
+		{
+			const int64_t n = (int64_t) NewHeight * Align;
+			int64_t a = SrcHeight;
+			int64_t b = n;
+
+			while( b != 0 )
+			{
+				const int64_t t = a % b;
+				a = b;
+				b = t;
+			}
+
+			const int64_t Period = n / a;
+			const int64_t Aligned = ( StripHeight + Period - 1 ) / Period *
+				Period;
+
+			if( Aligned <= (int64_t) StripHeight * 4 )
+			{
+				StripHeight = (int) Aligned;
+			}
+		}
+
+		const int NewScanlineSize = NewWidth * ElIncrIO;
+		CBuffer< Tout > StripBuf(( StripHeight + NewMargin * 2 ) *
+			NewScanlineSize );
+
+		int y0;
+
+		for( y0 = 0; y0 < NewHeight; y0 += StripHeight )
+		{
+			const int y1 = ( y0 + StripHeight < NewHeight ?
+				y0 + StripHeight : NewHeight );
+
+			const int e0 = ( y0 > NewMargin ? y0 - NewMargin : 0 );
+			const int e1 = ( y1 + NewMargin < NewHeight ? y1 + NewMargin :
+				NewHeight );
+
+			const double p0 = oy + e0 * ky;
+			const double p1 = oy + ( e1 - 1 ) * ky;
+			int s0 = (int) floor( p0 ) - Margin;
+			int s1 = (int) ceil( p1 ) + Margin + 1;
+
+			if( s0 < 0 )
+			{
+				s0 = 0;
+			}
+			else
+			{
+				s0 -= s0 % Align;
+			}
+
+			if( s1 > SrcHeight )
+			{
+				s1 = SrcHeight;
+			}
+
+			if( ElIncrIO != ElCountIO )
+			{
+				// Keep the skipped elements of the resulting rows.
+
+				memcpy( &StripBuf[ ( y0 - e0 ) * NewScanlineSize ],
+					NewBuf + (size_t) y0 * NewScanlineSize,
+					( y1 - y0 ) * NewScanlineSize * sizeof( Tout ));
+			}
+
+			// The first and the last strip are clipped by the image edges,
+			// so they keep plans of their own.
+
+			CPlan& StripPlan = Plan.StripPlans[ y0 == 0 ? 0 :
+				( y1 == NewHeight ? 2 : 1 )];
+
+			doResizeImage( SrcBuf + (size_t) s0 * SrcScanlineSize, SrcWidth,
+				s1 - s0, SrcScanlineSize, &StripBuf[ 0 ], NewWidth, e1 - e0,
+				ElCountIO, kx, ky, ox, p0 - s0, ModeH, ModeV, Vars,
+				StripPlan );
+
+			memcpy( NewBuf + (size_t) y0 * NewScanlineSize,
+				&StripBuf[ ( y0 - e0 ) * NewScanlineSize ],
+				( y1 - y0 ) * NewScanlineSize * sizeof( Tout ));
+		}
+	}
+
+private:
+	/**
+	 * Function evaluates horizontal and vertical resizing steps, and the
+	 * offsets that produce a "centered" image. See the resizeImage()
+	 * function for the description of parameters.
+	 *
+	 * @param[out] kx Horizontal resizing step.
+	 * @param[out] ky Vertical resizing step.
+	 * @param[out] ox Horizontal start offset.
+	 * @param[out] oy Vertical start offset.
+	 */
+
+	static void calcResizeSteps( const int SrcWidth, const int SrcHeight,
+		const int NewWidth, const int NewHeight, const double k,
+		const CImageResizerVars& Vars, double& kx, double& ky, double& ox,
+		double& oy )
+	{
+		ox = Vars.ox;
+		oy = Vars.oy;
 
 		if( k == 0.0 )
 		{
@@ -4418,129 +4893,77 @@ public:
 			kx = -k;
 			ky = -k;
 		}
+	}
 
-		// Evaluate pre-multipliers used on the output stage.
+	/**
+	 * @return The number of elements between adjacent source and destination
+	 * pixels, see CImageResizerVars::ElIncrIO.
+	 */
 
-		const bool IsInFloat = ( (Tin) 0.4 != 0 );
-		const bool IsOutFloat = ( (Tout) 0.4 != 0 );
-		double OutMul; // Output multiplier.
+	static int getElIncrIO( const CImageResizerVars& Vars,
+		const int ElCountIO )
+	{
+		return( Vars.ElIncrIO > ElCountIO ? Vars.ElIncrIO : ElCountIO );
+	}
 
-		if( Vars.UseSRGBGamma )
-		{
-			if( IsInFloat )
-			{
-				Vars.InGammaMult = 1.0;
-			}
-			else
-			{
-				Vars.InGammaMult =
-					1.0 / ( sizeof( Tin ) == 1 ? 255.0 : 65535.0 );
-			}
+	/**
+	 * Function resizes image using the specified resizing steps and offsets,
+	 * see the resizeImage() function for the description of parameters.
+	 * SrcWidth, SrcHeight, NewWidth and NewHeight should be non-zero.
+	 *
+	 * @param kx Horizontal resizing step.
+	 * @param ky Vertical resizing step.
+	 * @param ox Horizontal start offset.
+	 * @param oy Vertical start offset.
+	 * @param BuildModeH Build mode of the horizontal pass, -1 to select the
+	 * most efficient one.
+	 * @param BuildModeV Build mode of the vertical pass, -1 to select the
+	 * most efficient one.
+	 * @param Vars Variables passed to the resizeImage() function.
+	 * @param Plan Plan to use and rebuild if needed.
+	 */
 
-			if( IsOutFloat )
-			{
-				Vars.OutGammaMult = 1.0;
-			}
-			else
-			{
-				Vars.OutGammaMult = ( sizeof( Tout ) == 1 ? 255.0 : 65535.0 );
-			}
+	template< class Tin, class Tout >
+	void doResizeImage( const Tin* const SrcBuf, const int SrcWidth,
+		const int SrcHeight, int SrcScanlineSize, Tout* const NewBuf,
+		const int NewWidth, const int NewHeight, const int ElCountIO,
+		const double kx, const double ky, const double ox, const double oy,
+		const int BuildModeH, const int BuildModeV, CImageResizerVars& Vars,
+		CPlan& Plan ) const
+	{
+		CImageResizerThreadPool DefThreadPool;
+		CImageResizerThreadPool& ThreadPool = ( Vars.ThreadPool == NULL ?
+			DefThreadPool : *Vars.ThreadPool );
 
-			OutMul = 1.0;
+		const bool IsInFloat = ( (Tin) 0.4 != 0 );
+		const bool IsOutFloat = ( (Tout) 0.4 != 0 );
+
+		if( !Plan.isBuiltFor( SrcWidth, SrcHeight, NewWidth, NewHeight,
+			ElCountIO, kx, ky, ox, oy, BuildModeH, BuildModeV, Vars,
+			IsInFloat, sizeof( Tin ), IsOutFloat, sizeof( Tout )))
+		{
+			buildPlan( Plan, SrcWidth, SrcHeight, NewWidth, NewHeight,
+				ElCountIO, kx, ky, ox, oy, BuildModeH, BuildModeV, Vars,
+				IsInFloat, sizeof( Tin ), IsOutFloat, sizeof( Tout ));
 		}
 		else
 		{
-			if( IsOutFloat )
-			{
-				OutMul = 1.0;
-			}
-			else
-			{
-				OutMul = ( sizeof( Tout ) == 1 ? 255.0 : 65535.0 );
-			}
-
-			if( !IsInFloat )
-			{
-				OutMul /= ( sizeof( Tin ) == 1 ? 255.0 : 65535.0 );
-			}
+			Plan.HitCount++;
 		}
 
 		// Fill widely-used variables.
 
-		const int ElCount = ( ElCountIO + fpclass :: fppack - 1 ) /
-			fpclass :: fppack;
-
+		const int ElCount = Plan.VarsH.ElCount;
 		const int NewWidthE = NewWidth * ElCount;
+		const int ElIncrIO = Plan.VarsH.ElIncrIO;
 
 		if( SrcScanlineSize < 1 )
 		{
-			SrcScanlineSize = SrcWidth * ElCountIO;
+			SrcScanlineSize = SrcWidth * ElIncrIO;
 		}
 
-		Vars.ElCount = ElCount;
-		Vars.ElCountIO = ElCountIO;
-		Vars.fppack = fpclass :: fppack;
-		Vars.fpalign = fpclass :: fpalign;
-		Vars.elalign = fpclass :: elalign;
-
 		// Horizontal scanline filtering and resizing.
 
-		CDSPFracFilterBankLin< fptype > FltBank;
-		CFilterSteps FltSteps;
-		typename CFilterStep :: CRPosBufArray RPosBufArray;
-		CBuffer< uint8_t > UsedFracMap;
-
-		// Perform the filtering steps modeling at various modes, find the
-		// most efficient mode for both horizontal and vertical resizing.
-
-		int UseBuildMode = 1;
-		const int BuildModeCount =
-			( FixedFilterBank.getOrder() == 0 ? 4 : 2 );
-
-		int m;
-
-		if( Vars.BuildMode >= 0 )
-		{
-			UseBuildMode = Vars.BuildMode;
-		}
-		else
-		{
-			int BestScore = 0x7FFFFFFF;
-
-			for( m = 0; m < BuildModeCount; m++ )
-			{
-				CDSPFracFilterBankLin< fptype > TmpBank;
-				CFilterSteps TmpSteps;
-				Vars.k = kx;
-				Vars.o = ox;
-				buildFilterSteps( TmpSteps, Vars, TmpBank, OutMul, m, true );
-				updateFilterStepBuffers( TmpSteps, Vars, RPosBufArray,
-					SrcWidth, NewWidth );
-
-				fillUsedFracMap( TmpSteps[ Vars.ResizeStep ], UsedFracMap );
-				const int c = calcComplexity( TmpSteps, Vars, UsedFracMap,
-					SrcHeight );
-
-				if( c < BestScore )
-				{
-					UseBuildMode = m;
-					BestScore = c;
-				}
-			}
-		}
-
-		// Perform the actual filtering steps building.
-
-		Vars.k = kx;
-		Vars.o = ox;
-		buildFilterSteps( FltSteps, Vars, FltBank, OutMul, UseBuildMode,
-			false );
-
-		updateFilterStepBuffers( FltSteps, Vars, RPosBufArray, SrcWidth,
-			NewWidth );
-
-		updateBufLenAndRPosPtrs( FltSteps, Vars, NewWidth );
-
 		const int ThreadCount = ThreadPool.getSuggestedWorkloadCount();
 			// Includes the current thread.
 
@@ -4555,15 +4978,19 @@ public:
 				ThreadPool.addWorkload( &td[ i ]);
 			}
 
-			td[ i ].init( i, ThreadCount, FltSteps, Vars );
+			td[ i ].init( i, ThreadCount, Plan.FltStepsH, Plan.VarsH );
 
 			td[ i ].initScanlineQueue( td[ i ].sopResizeH, SrcHeight,
 				SrcWidth );
 		}
 
-		CBuffer< fptype > FltBuf( NewWidthE * SrcHeight, fpclass :: fpalign );
-			// Temporary buffer that receives horizontally-filtered and
-			// resized image.
+		CBuffer< fptype >& FltBuf = Plan.FltBuf; // Temporary buffer that
+			// receives horizontally-filtered and resized image.
+
+		if( FltBuf.getCapacity() < NewWidthE * SrcHeight )
+		{
+			FltBuf.alloc( NewWidthE * SrcHeight, fpclass :: fpalign );
+		}
 
 		for( i = 0; i < SrcHeight; i++ )
 		{
@@ -4576,68 +5003,15 @@ public:
 		td[ 0 ].processScanlineQueue();
 		ThreadPool.waitAllWorkloadsToFinish();
 
-		// Vertical scanline filtering and resizing, reuse previously defined
-		// filtering steps if possible.
-
-		const int PrevUseBuildMode = UseBuildMode;
-
-		if( Vars.BuildMode >= 0 )
-		{
-			UseBuildMode = Vars.BuildMode;
-		}
-		else
-		{
-			CImageResizerVars TmpVars( Vars );
-			int BestScore = 0x7FFFFFFF;
-
-			for( m = 0; m < BuildModeCount; m++ )
-			{
-				CDSPFracFilterBankLin< fptype > TmpBank;
-				TmpBank.copyInitParams( FltBank );
-				CFilterSteps TmpSteps;
-				TmpVars.k = ky;
-				TmpVars.o = oy;
-				buildFilterSteps( TmpSteps, TmpVars, TmpBank, 1.0, m, true );
-				updateFilterStepBuffers( TmpSteps, TmpVars, RPosBufArray,
-					SrcHeight, NewHeight );
-
-				fillUsedFracMap( TmpSteps[ TmpVars.ResizeStep ],
-					UsedFracMap );
-
-				const int c = calcComplexity( TmpSteps, TmpVars, UsedFracMap,
-					NewWidth );
-
-				if( c < BestScore )
-				{
-					UseBuildMode = m;
-					BestScore = c;
-				}
-			}
-		}
-
-		Vars.k = ky;
-		Vars.o = oy;
+		// Vertical scanline filtering and resizing.
 
-		if( UseBuildMode == PrevUseBuildMode && ky == kx )
-		{
-			if( OutMul != 1.0 )
-			{
-				modifyCorrFilterDCGain( FltSteps, 1.0 / OutMul );
-			}
-		}
-		else
+		for( i = 0; i < ThreadCount; i++ )
 		{
-			buildFilterSteps( FltSteps, Vars, FltBank, 1.0, UseBuildMode,
-				false );
+			td[ i ].init( i, ThreadCount, Plan.FltStepsV, Plan.VarsV );
 		}
 
-		updateFilterStepBuffers( FltSteps, Vars, RPosBufArray, SrcHeight,
-			NewHeight );
-
-		updateBufLenAndRPosPtrs( FltSteps, Vars, NewWidth );
-
 		if( IsOutFloat && sizeof( FltBuf[ 0 ]) == sizeof( Tout ) &&
-			fpclass :: elalign == 1 )
+			fpclass :: elalign == 1 && ElIncrIO == ElCountIO )
 		{
 			// In-place output.
 
@@ -4658,11 +5032,17 @@ public:
 			ThreadPool.waitAllWorkloadsToFinish();
 			ThreadPool.removeAllWorkloads();
 
+			Plan.exportVars( Vars );
 			fpclass :: CReset :: reset();
 			return;
 		}
 
-		CBuffer< fptype > ResBuf( NewWidthE * NewHeight, fpclass :: fpalign );
+		CBuffer< fptype >& ResBuf = Plan.ResBuf;
+
+		if( ResBuf.getCapacity() < NewWidthE * NewHeight )
+		{
+			ResBuf.alloc( NewWidthE * NewHeight, fpclass :: fpalign );
+		}
 
 		for( i = 0; i < ThreadCount; i++ )
 		{
@@ -4696,7 +5076,7 @@ public:
 			{
 				td[ i % ThreadCount ].addScanlineToQueue(
 					&ResBuf[ i * NewWidthE ],
-					&NewBuf[ i * NewWidth * ElCountIO ]);
+					&NewBuf[ i * NewWidth * ElIncrIO ]);
 			}
 
 			ThreadPool.startAllWorkloads();
@@ -4704,6 +5084,7 @@ public:
 			ThreadPool.waitAllWorkloadsToFinish();
 			ThreadPool.removeAllWorkloads();
 
+			Plan.exportVars( Vars );
 			fpclass :: CReset :: reset();
 			return;
 		}
@@ -4728,21 +5109,22 @@ public:
 
 		if( CDitherer :: isRecursive() )
 		{
-			td[ 0 ].getDitherer().init( NewWidth, Vars, TrMul, PkOut );
+			td[ 0 ].getDitherer().init( NewWidth, Plan.VarsV, TrMul, PkOut );
 
-			if( Vars.UseSRGBGamma )
+			if( Plan.VarsV.UseSRGBGamma )
 			{
 				for( i = 0; i < NewHeight; i++ )
 				{
 					fptype* const ResScanline = &ResBuf[ i * NewWidthE ];
 
 					CFilterStep :: applySRGBGamma( ResScanline, NewWidth,
-						Vars );
+						Plan.VarsV );
 
 					td[ 0 ].getDitherer().dither( ResScanline );
 
 					CFilterStep :: unpackScanline( ResScanline,
-						&NewBuf[ i * NewWidth * ElCountIO ], NewWidth, Vars );
+						&NewBuf[ i * NewWidth * ElIncrIO ], NewWidth,
+						Plan.VarsV );
 				}
 			}
 			else
@@ -4754,7 +5136,8 @@ public:
 					td[ 0 ].getDitherer().dither( ResScanline );
 
 					CFilterStep :: unpackScanline( ResScanline,
-						&NewBuf[ i * NewWidth * ElCountIO ], NewWidth, Vars );
+						&NewBuf[ i * NewWidth * ElIncrIO ], NewWidth,
+						Plan.VarsV );
 				}
 			}
 		}
@@ -4765,14 +5148,15 @@ public:
 				td[ i ].initScanlineQueue( td[ i ].sopDitherAndUnpackH,
 					NewHeight, NewWidth );
 
-				td[ i ].getDitherer().init( NewWidth, Vars, TrMul, PkOut );
+				td[ i ].getDitherer().init( NewWidth, Plan.VarsV, TrMul,
+					PkOut );
 			}
 
 			for( i = 0; i < NewHeight; i++ )
 			{
 				td[ i % ThreadCount ].addScanlineToQueue(
 					&ResBuf[ i * NewWidthE ],
-					&NewBuf[ i * NewWidth * ElCountIO ]);
+					&NewBuf[ i * NewWidth * ElIncrIO ]);
 			}
 
 			ThreadPool.startAllWorkloads();
@@ -4782,6 +5166,7 @@ public:
 
 		ThreadPool.removeAllWorkloads();
 
+		Plan.exportVars( Vars );
 		fpclass :: CReset :: reset();
 	}
 
@@ -4814,6 +5199,418 @@ private:
 
 	typedef CStructArray< CFilterStep > CFilterSteps;
 
+public:
+	/**
+	 * @brief Resizing plan class.
+	 *
+	 * The object of this class holds the filtering steps, filter banks,
+	 * resizing positions and intermediate buffers the resizeImage() function
+	 * builds for a given pair of image sizes. When the same object is passed
+	 * to subsequent resizeImage() calls with the same sizes and input
+	 * variables, all of these are reused instead of being built again. A plan
+	 * may only be used with the resizer object that built it, and only by one
+	 * resizeImage() call at a time.
+	 */
+
+	class CPlan
+	{
+	public:
+		CPlan()
+			: IsBuilt( false )
+			, HitCount( 0 )
+			, BuildCount( 0 )
+		{
+		}
+
+		/**
+		 * Function invalidates *this plan so that it gets rebuilt on the
+		 * next use, and releases the intermediate buffers and strip plans.
+		 */
+
+		void clear()
+		{
+			IsBuilt = false;
+			FltBuf.free();
+			ResBuf.free();
+			StripPlans.clear();
+		}
+
+		/**
+		 * @return The number of resizeImage() calls that reused *this plan.
+		 */
+
+		int getHitCount() const
+		{
+			return( HitCount );
+		}
+
+		/**
+		 * @return The number of times *this plan was (re)built.
+		 */
+
+		int getBuildCount() const
+		{
+			return( BuildCount );
+		}
+
+	private:
+		friend class CImageResizer;
+
+		bool IsBuilt; ///< "True" if the variables below are valid.
+			///<
+		int HitCount; ///< The number of times the plan was reused.
+			///<
+		int BuildCount; ///< The number of times the plan was built.
+			///<
+		int SrcWidth; ///< Source image width the plan was built for.
+			///<
+		int SrcHeight; ///< Source image height the plan was built for.
+			///<
+		int NewWidth; ///< New image width the plan was built for.
+			///<
+		int NewHeight; ///< New image height the plan was built for.
+			///<
+		int ElCountIO; ///< Element count the plan was built for.
+			///<
+		double kx; ///< Horizontal resizing step the plan was built for.
+			///<
+		double ky; ///< Vertical resizing step the plan was built for.
+			///<
+		double ox; ///< Horizontal start offset the plan was built for.
+			///<
+		double oy; ///< Vertical start offset the plan was built for.
+			///<
+		bool UseSRGBGamma; ///< Gamma mode the plan was built for.
+			///<
+		int BuildModeH; ///< Requested horizontal build mode the plan was
+			///< built for.
+			///<
+		int BuildModeV; ///< Requested vertical build mode the plan was built
+			///< for.
+			///<
+		int UsedBuildModeH; ///< Build mode used by the horizontal pass.
+			///<
+		int UsedBuildModeV; ///< Build mode used by the vertical pass.
+			///<
+		int DecimationV; ///< The overall downsampling factor of the vertical
+			///< filtering steps that precede the resizing step.
+			///<
+		bool IsInFloat; ///< "True" if the input type is floating point.
+			///<
+		int InElSize; ///< Size of the input element type, in bytes.
+			///<
+		bool IsOutFloat; ///< "True" if the output type is floating point.
+			///<
+		int OutElSize; ///< Size of the output element type, in bytes.
+			///<
+		CImageResizerVars VarsH; ///< Variables of the horizontal pass.
+			///<
+		CImageResizerVars VarsV; ///< Variables of the vertical pass.
+			///<
+		CDSPFracFilterBankLin< fptype > FltBankH; ///< Filter bank used by
+			///< the horizontal pass, may also be used by the vertical pass.
+			///<
+		CDSPFracFilterBankLin< fptype > FltBankV; ///< Filter bank used by
+			///< the vertical pass if it could not reuse FltBankH.
+			///<
+		CFilterSteps FltStepsH; ///< Horizontal filtering steps.
+			///<
+		CFilterSteps FltStepsV; ///< Vertical filtering steps.
+			///<
+		typename CFilterStep :: CRPosBufArray RPosBufArray; ///< Resizing
+			///< positions of both passes.
+			///<
+		CBuffer< fptype > FltBuf; ///< Horizontally-filtered image.
+			///<
+		CBuffer< fptype > ResBuf; ///< Vertically-filtered image.
+			///<
+		CStructArray< CPlan > StripPlans; ///< Plans of the first, inner and
+			///< last strips, if *this plan was built by resizeImageStrips().
+			///<
+
+		/**
+		 * @return "True" if *this plan was built for the specified resizing
+		 * parameters and can be reused.
+		 */
+
+		bool isBuiltFor( const int aSrcWidth, const int aSrcHeight,
+			const int aNewWidth, const int aNewHeight, const int aElCountIO,
+			const double akx, const double aky, const double aox,
+			const double aoy, const int aBuildModeH, const int aBuildModeV,
+			const CImageResizerVars& Vars, const bool aIsInFloat, const int aInElSize,
+			const bool aIsOutFloat, const int aOutElSize ) const
+		{
+			return( IsBuilt && SrcWidth == aSrcWidth &&
+				SrcHeight == aSrcHeight && NewWidth == aNewWidth &&
+				NewHeight == aNewHeight && ElCountIO == aElCountIO &&
+				VarsH.ElIncrIO == getElIncrIO( Vars, aElCountIO ) &&
+				kx == akx && ky == aky && ox == aox && oy == aoy &&
+				UseSRGBGamma == Vars.UseSRGBGamma &&
+				BuildModeH == aBuildModeH && BuildModeV == aBuildModeV &&
+				IsInFloat == aIsInFloat &&
+				InElSize == aInElSize && IsOutFloat == aIsOutFloat &&
+				OutElSize == aOutElSize );
+		}
+
+		/**
+		 * Function copies the variables produced by the last pass to the
+		 * caller's variables object, leaving the input variables intact.
+		 *
+		 * @param[out] Vars Caller's variables object.
+		 */
+
+		void exportVars( CImageResizerVars& Vars ) const
+		{
+			const CImageResizerVars InVars( Vars );
+			Vars = VarsV;
+			Vars.ox = InVars.ox;
+			Vars.oy = InVars.oy;
+			Vars.ElIncrIO = InVars.ElIncrIO;
+			Vars.ThreadPool = InVars.ThreadPool;
+			Vars.RndSeed = InVars.RndSeed;
+		}
+	};
+
+private:
+	/**
+	 * Function builds the filtering steps of both resizing passes and stores
+	 * them in the specified plan object. See the doResizeImage() function
+	 * for the description of parameters.
+	 *
+	 * @param[out] Plan Plan to build.
+	 * @param IsInFloat "True" if the input element type is floating point.
+	 * @param InElSize Size of the input element type, in bytes.
+	 * @param IsOutFloat "True" if the output element type is floating point.
+	 * @param OutElSize Size of the output element type, in bytes.
+	 */
+
+	void buildPlan( CPlan& Plan, const int SrcWidth, const int SrcHeight,
+		const int NewWidth, const int NewHeight, const int ElCountIO,
+		const double kx, const double ky, const double ox, const double oy,
+		const int BuildModeH, const int BuildModeV,
+		const CImageResizerVars& Vars, const bool IsInFloat,
+		const int InElSize, const bool IsOutFloat, const int OutElSize ) const
+	{
+		Plan.IsBuilt = false;
+		Plan.BuildCount++;
+
+		// Evaluate pre-multipliers used on the output stage.
+
+		CImageResizerVars& VarsH = Plan.VarsH;
+		VarsH = Vars;
+		double OutMul; // Output multiplier.
+
+		if( Vars.UseSRGBGamma )
+		{
+			if( IsInFloat )
+			{
+				VarsH.InGammaMult = 1.0;
+			}
+			else
+			{
+				VarsH.InGammaMult =
+					1.0 / ( InElSize == 1 ? 255.0 : 65535.0 );
+			}
+
+			if( IsOutFloat )
+			{
+				VarsH.OutGammaMult = 1.0;
+			}
+			else
+			{
+				VarsH.OutGammaMult = ( OutElSize == 1 ? 255.0 : 65535.0 );
+			}
+
+			OutMul = 1.0;
+		}
+		else
+		{
+			if( IsOutFloat )
+			{
+				OutMul = 1.0;
+			}
+			else
+			{
+				OutMul = ( OutElSize == 1 ? 255.0 : 65535.0 );
+			}
+
+			if( !IsInFloat )
+			{
+				OutMul /= ( InElSize == 1 ? 255.0 : 65535.0 );
+			}
+		}
+
+		// Fill widely-used variables.
+
+		VarsH.ElCount = ( ElCountIO + fpclass :: fppack - 1 ) /
+			fpclass :: fppack;
+
+		VarsH.ElCountIO = ElCountIO;
+		VarsH.ElIncrIO = getElIncrIO( Vars, ElCountIO );
+		VarsH.fppack = fpclass :: fppack;
+		VarsH.fpalign = fpclass :: fpalign;
+		VarsH.elalign = fpclass :: elalign;
+
+		// Horizontal scanline filtering and resizing.
+
+		CDSPFracFilterBankLin< fptype >& FltBank = Plan.FltBankH;
+		CFilterSteps& FltSteps = Plan.FltStepsH;
+		typename CFilterStep :: CRPosBufArray& RPosBufArray =
+			Plan.RPosBufArray;
+
+		CBuffer< uint8_t > UsedFracMap;
+
+		// Perform the filtering steps modeling at various modes, find the
+		// most efficient mode for both horizontal and vertical resizing.
+
+		int UseBuildMode = 1;
+		const int BuildModeCount = getBuildModeCount();
+
+		int m;
+
+		if( BuildModeH >= 0 )
+		{
+			UseBuildMode = BuildModeH;
+		}
+		else
+		{
+			int BestScore = 0x7FFFFFFF;
+
+			for( m = 0; m < BuildModeCount; m++ )
+			{
+				CDSPFracFilterBankLin< fptype > TmpBank;
+				CFilterSteps TmpSteps;
+				VarsH.k = kx;
+				VarsH.o = ox;
+				buildFilterSteps( TmpSteps, VarsH, TmpBank, OutMul, m, true );
+				updateFilterStepBuffers( TmpSteps, VarsH, RPosBufArray,
+					SrcWidth, NewWidth );
+
+				fillUsedFracMap( TmpSteps[ VarsH.ResizeStep ], UsedFracMap );
+				const int c = calcComplexity( TmpSteps, VarsH, UsedFracMap,
+					SrcHeight );
+
+				if( c < BestScore )
+				{
+					UseBuildMode = m;
+					BestScore = c;
+				}
+			}
+		}
+
+		// Perform the actual filtering steps building.
+
+		VarsH.k = kx;
+		VarsH.o = ox;
+		buildFilterSteps( FltSteps, VarsH, FltBank, OutMul, UseBuildMode,
+			false );
+
+		updateFilterStepBuffers( FltSteps, VarsH, RPosBufArray, SrcWidth,
+			NewWidth );
+
+		updateBufLenAndRPosPtrs( FltSteps, VarsH, NewWidth );
+
+		// Vertical scanline filtering and resizing, reuse previously defined
+		// filtering steps if possible.
+
+		CImageResizerVars& VarsV = Plan.VarsV;
+		VarsV = VarsH;
+		CFilterSteps& FltStepsV = Plan.FltStepsV;
+		const int PrevUseBuildMode = UseBuildMode;
+
+		if( BuildModeV >= 0 )
+		{
+			UseBuildMode = BuildModeV;
+		}
+		else
+		{
+			CImageResizerVars TmpVars( VarsV );
+			int BestScore = 0x7FFFFFFF;
+
+			for( m = 0; m < BuildModeCount; m++ )
+			{
+				CDSPFracFilterBankLin< fptype > TmpBank;
+				TmpBank.copyInitParams( FltBank );
+				CFilterSteps TmpSteps;
+				TmpVars.k = ky;
+				TmpVars.o = oy;
+				buildFilterSteps( TmpSteps, TmpVars, TmpBank, 1.0, m, true );
+				updateFilterStepBuffers( TmpSteps, TmpVars, RPosBufArray,
+					SrcHeight, NewHeight );
+
+				fillUsedFracMap( TmpSteps[ TmpVars.ResizeStep ],
+					UsedFracMap );
+
+				const int c = calcComplexity( TmpSteps, TmpVars, UsedFracMap,
+					NewWidth );
+
+				if( c < BestScore )
+				{
+					UseBuildMode = m;
+					BestScore = c;
+				}
+			}
+		}
+
+		VarsV.k = ky;
+		VarsV.o = oy;
+
+		if( UseBuildMode == PrevUseBuildMode && ky == kx )
+		{
+			// The copied steps keep pointing to FltBankH which is left
+			// unchanged from now on.
+
+			FltStepsV = FltSteps;
+
+			if( OutMul != 1.0 )
+			{
+				modifyCorrFilterDCGain( FltStepsV, 1.0 / OutMul );
+			}
+		}
+		else
+		{
+			buildFilterSteps( FltStepsV, VarsV, Plan.FltBankV, 1.0,
+				UseBuildMode, false );
+		}
+
+		updateFilterStepBuffers( FltStepsV, VarsV, RPosBufArray, SrcHeight,
+			NewHeight );
+
+		updateBufLenAndRPosPtrs( FltStepsV, VarsV, NewWidth );
+
+		Plan.DecimationV = 1;
+
+		for( m = 0; m < FltStepsV.getItemCount(); m++ )
+		{
+			const CFilterStep& fs = FltStepsV[ m ];
+
+			if( !fs.IsUpsample && fs.ResampleFactor > 1 )
+			{
+				Plan.DecimationV *= fs.ResampleFactor;
+			}
+		}
+
+		Plan.UsedBuildModeH = PrevUseBuildMode;
+		Plan.UsedBuildModeV = UseBuildMode;
+		Plan.SrcWidth = SrcWidth;
+		Plan.SrcHeight = SrcHeight;
+		Plan.NewWidth = NewWidth;
+		Plan.NewHeight = NewHeight;
+		Plan.ElCountIO = ElCountIO;
+		Plan.kx = kx;
+		Plan.ky = ky;
+		Plan.ox = ox;
+		Plan.oy = oy;
+		Plan.UseSRGBGamma = Vars.UseSRGBGamma;
+		Plan.BuildModeH = BuildModeH;
+		Plan.BuildModeV = BuildModeV;
+		Plan.IsInFloat = IsInFloat;
+		Plan.InElSize = InElSize;
+		Plan.IsOutFloat = IsOutFloat;
+		Plan.OutElSize = OutElSize;
+		Plan.IsBuilt = true;
+	}
+
 	/**
 	 * Function initializes the filter bank in the specified resizing step
 	 * according to the source and resulting image bit depths.
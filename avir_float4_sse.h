@@ -0,0 +1,206 @@
+//$ nobt
+//$ nocpp
+
+/**
+ * @file avir_float4_sse.h
+ *
+ * @brief Inclusion file for the "float4" type.
+ *
+ * This file includes the "float4" SSE-based type used for SIMD variable
+ * storage and processing, and the fpclass_float4 definition class that makes
+ * the image resizer store each 1-4 channel pixel in a single SSE register.
+ *
+ * AVIR Copyright (c) 2015-2016 Aleksey Vaneev
+ */
+
+#ifndef AVIR_FLOAT4_SSE_INCLUDED
+#define AVIR_FLOAT4_SSE_INCLUDED
+
+#include "avir.h"
+#include <emmintrin.h>
+
+namespace avir {
+
+/**
+ * @brief SIMD packed 4-float type.
+ *
+ * This class implements a packed 4-float type that can be used to perform
+ * parallel computation using SIMD instructions on SSE2-enabled processors.
+ * The image resizer stores all channels of a pixel in one value of this type,
+ * so that every filter tap is applied to all channels with a single
+ * multiply and add. Conversion to "float" returns the first element. The type
+ * is trivially copyable, as AVIR copies and clears its buffers with memcpy()
+ * and memset().
+ */
+
+class float4
+{
+public:
+	float4() = default;
+
+	float4( const __m128 s )
+		: value( s )
+	{
+	}
+
+	float4( const float s )
+		: value( _mm_set1_ps( s ))
+	{
+	}
+
+	float4& operator = ( const __m128 s )
+	{
+		value = s;
+		return( *this );
+	}
+
+	float4& operator = ( const float s )
+	{
+		value = _mm_set1_ps( s );
+		return( *this );
+	}
+
+	operator float () const
+	{
+		return( _mm_cvtss_f32( value ));
+	}
+
+	/**
+	 * @param p Pointer to memory from where the value should be loaded,
+	 * should be 16-byte aligned.
+	 * @return float4 value loaded from the specified memory location.
+	 */
+
+	static float4 load( const float* const p )
+	{
+		return( _mm_load_ps( p ));
+	}
+
+	/**
+	 * @param p Pointer to memory from where the value should be loaded,
+	 * may have any alignment.
+	 * @return float4 value loaded from the specified memory location.
+	 */
+
+	static float4 loadu( const float* const p )
+	{
+		return( _mm_loadu_ps( p ));
+	}
+
+	/**
+	 * Function stores *this value to the specified memory location.
+	 *
+	 * @param[out] p Output memory location, should be 16-byte aligned.
+	 */
+
+	void store( float* const p ) const
+	{
+		_mm_store_ps( p, value );
+	}
+
+	/**
+	 * Function stores *this value to the specified memory location.
+	 *
+	 * @param[out] p Output memory location, may have any alignment.
+	 */
+
+	void storeu( float* const p ) const
+	{
+		_mm_storeu_ps( p, value );
+	}
+
+	float4& operator += ( const float4& s )
+	{
+		value = _mm_add_ps( value, s.value );
+		return( *this );
+	}
+
+	float4& operator -= ( const float4& s )
+	{
+		value = _mm_sub_ps( value, s.value );
+		return( *this );
+	}
+
+	float4& operator *= ( const float4& s )
+	{
+		value = _mm_mul_ps( value, s.value );
+		return( *this );
+	}
+
+	float4& operator /= ( const float4& s )
+	{
+		value = _mm_div_ps( value, s.value );
+		return( *this );
+	}
+
+	float4 operator + ( const float4& s ) const
+	{
+		return( _mm_add_ps( value, s.value ));
+	}
+
+	float4 operator - ( const float4& s ) const
+	{
+		return( _mm_sub_ps( value, s.value ));
+	}
+
+	float4 operator * ( const float4& s ) const
+	{
+		return( _mm_mul_ps( value, s.value ));
+	}
+
+	float4 operator / ( const float4& s ) const
+	{
+		return( _mm_div_ps( value, s.value ));
+	}
+
+	__m128 value; ///< Packed value of 4 floats.
+		///<
+};
+
+/**
+ * SIMD rounding function, element-wise equivalent to the generic avir::round()
+ * function: halves are rounded away from zero.
+ *
+ * @param v Value to round.
+ * @return Rounded SIMD value.
+ */
+
+inline float4 round( const float4& v )
+{
+	const __m128 SignMask = _mm_set1_ps( -0.0f );
+	const __m128 a = _mm_andnot_ps( SignMask, v.value );
+	const __m128 r = _mm_cvtepi32_ps( _mm_cvttps_epi32(
+		_mm_add_ps( a, _mm_set1_ps( 0.5f ))));
+
+	return( _mm_or_ps( r, _mm_and_ps( SignMask, v.value )));
+}
+
+/**
+ * SIMD function "clamps" (clips) the specified packed values so that they are
+ * not lesser than "minv", and not greater than "maxv".
+ *
+ * @param Value Value to clamp.
+ * @param minv Minimal allowed value.
+ * @param maxv Maximal allowed value.
+ * @return The clamped value.
+ */
+
+inline float4 clamp( const float4& Value, const float4& minv,
+	const float4& maxv )
+{
+	return( _mm_min_ps( _mm_max_ps( Value.value, minv.value ), maxv.value ));
+}
+
+/**
+ * @brief Floating-point processing definition class for the float4 type.
+ *
+ * The interleaved filtering step and the default ditherer are used: each
+ * float4 element holds all channels of a single pixel, so the ElCount
+ * variable equals 1 for 1 to 4 channel images.
+ */
+
+typedef fpclass_def< avir :: float4, float > fpclass_float4;
+
+} // namespace avir
+
+#endif // AVIR_FLOAT4_SSE_INCLUDED
@@ -0,0 +1,80 @@
+#include "avirtuning.h"
+#include <QHash>
+#include <QMutex>
+#include <QSettings>
+
+namespace
+{
+  const char* const QualityNames[] = {"Low", "Default", "LR", "High", "Ultra"};
+  const char* const TuningFile = "avir-tuning";
+
+  // One key per quality and size pair, e.g. "LR/1024x768-256x192"
+  QString tuningKey(const QSize& size, float factor, AvirQuality quality)
+  {
+    return QString("%1/%2x%3-%4x%5").arg(AvirQualityName(quality))
+        .arg(size.width()).arg(size.height())
+        .arg(int(size.width()*factor)).arg(int(size.height()*factor));
+  }
+
+  // The tuning file is read on first use, lookups after that stay in memory
+  struct TuningTable
+  {
+    QMutex mutex;
+    bool loaded = false;
+    QHash<QString, int> buildModes;
+
+    void load()
+    {
+      if(loaded)
+        return;
+      QSettings settings(QSettings::IniFormat, QSettings::UserScope, "SuperPosterize", TuningFile);
+      settings.beginGroup("BuildMode");
+      for(const QString& key : settings.allKeys())
+        buildModes.insert(key, settings.value(key).toInt());
+      loaded = true;
+    }
+  };
+
+  TuningTable& tuningTable()
+  {
+    static TuningTable table;
+    return table;
+  }
+}
+
+QString AvirQualityName(AvirQuality quality)
+{
+  return QualityNames[int(quality)];
+}
+
+bool ParseAvirQuality(const QString& name, AvirQuality* quality)
+{
+  for(int i = 0; i <= int(AvirQuality::Ultra); ++i)
+  {
+    if(name.compare(QualityNames[i], Qt::CaseInsensitive) == 0)
+    {
+      *quality = AvirQuality(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+int TunedAvirBuildMode(const QSize& size, float factor, AvirQuality quality)
+{
+  TuningTable& table = tuningTable();
+  QMutexLocker lock(&table.mutex);
+  table.load();
+  return table.buildModes.value(tuningKey(size, factor, quality), -1);
+}
+
+void SaveTunedAvirBuildMode(const QSize& size, float factor, AvirQuality quality, int buildMode)
+{
+  TuningTable& table = tuningTable();
+  QMutexLocker lock(&table.mutex);
+  table.load();
+  table.buildModes.insert(tuningKey(size, factor, quality), buildMode);
+
+  QSettings settings(QSettings::IniFormat, QSettings::UserScope, "SuperPosterize", TuningFile);
+  settings.setValue("BuildMode/" + tuningKey(size, factor, quality), buildMode);
+}
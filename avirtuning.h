@@ -0,0 +1,13 @@
+#pragma once
+
+#include <QSize>
+#include <QString>
+#include "filters.h"
+
+QString AvirQualityName(AvirQuality quality);
+bool ParseAvirQuality(const QString& name, AvirQuality* quality);
+
+// Build modes found by AutotuneAvirBuildMode, kept in an INI file between runs.
+// Returns -1 when the resize has not been tuned.
+int TunedAvirBuildMode(const QSize& size, float factor, AvirQuality quality);
+void SaveTunedAvirBuildMode(const QSize& size, float factor, AvirQuality quality, int buildMode);
@@ -0,0 +1,98 @@
+#include "dpidselftest.h"
+#include <cmath>
+#include <random>
+#include "filters.h"
+
+namespace
+{
+  // The guide colour's weight in the kernels
+  const double RefWeight = 0.01;
+
+  QImage randomImage(int width, int height, std::mt19937& random)
+  {
+    QImage image(width, height, QImage::Format_ARGB32);
+    for(int y = 0; y < height; ++y)
+    {
+      QRgb* line = (QRgb*)image.scanLine(y);
+      for(int x = 0; x < width; ++x)
+        line[x] = random();
+    }
+    return image;
+  }
+
+  // Part of source pixel s inside output pixel i's footprint [i*scale, (i+1)*scale)
+  double coverage(int i, int s, double scale, int srcSize)
+  {
+    const double begin = i * scale;
+    const double end = qMin((i + 1) * scale, double(srcSize));
+    return qMax(0.0, qMin(s + 1.0, end) - qMax(double(s), begin));
+  }
+
+  // One output pixel as the kernels computed it before the weight table
+  QRgb referencePixel(const QImage& src, QRgb refColor, int x, int y, double scale, float sharpeningCurve)
+  {
+    double cumWeight = RefWeight;
+    double red   = qRed(refColor)*RefWeight;
+    double green = qGreen(refColor)*RefWeight;
+    double blue  = qBlue(refColor)*RefWeight;
+    double alpha = qAlpha(refColor)*RefWeight;
+
+    const int endY = qMin(int(ceil((y + 1) * scale)), src.height());
+    const int endX = qMin(int(ceil((x + 1) * scale)), src.width());
+    for(int sy = int(floor(y * scale)); sy < endY; ++sy)
+    {
+      const QRgb* line = (const QRgb*)src.constScanLine(sy);
+      for(int sx = int(floor(x * scale)); sx < endX; ++sx)
+      {
+        const QRgb val = line[sx];
+        const double dr = qRed(val) - qRed(refColor);
+        const double dg = qGreen(val) - qGreen(refColor);
+        const double db = qBlue(val) - qBlue(refColor);
+        const double da = qAlpha(val) - qAlpha(refColor);
+        const double distance = sqrt(dr*dr + dg*dg + db*db + da*da) / 255.0;
+        const double w = pow(distance, double(sharpeningCurve)) *
+                         coverage(x, sx, scale, src.width()) * coverage(y, sy, scale, src.height());
+
+        cumWeight += w;
+        red   += qRed(val) * w;
+        green += qGreen(val) * w;
+        blue  += qBlue(val) * w;
+        alpha += qAlpha(val) * w;
+      }
+    }
+    return qRgba(red / cumWeight, green / cumWeight, blue / cumWeight, alpha / cumWeight);
+  }
+}
+
+int DpidKernelSelfTest()
+{
+  // Guides are rounded up to cover sizes no factor divides, so the clipped footprints at the
+  // right and bottom edges take the scalar kernel
+  std::mt19937 random(1);
+  const QImage source = randomImage(67, 61, random);
+
+  int difference = 0;
+  const float curves[] = {0.0f, 0.5f, 1.7f};
+  const float factors[] = {2.0f, 3.0f, 4.0f, 5.0f, 8.0f, 13.0f, 2.5f, 3.7f};
+  for(float sharpeningCurve : curves)
+  {
+    for(float factor : factors)
+    {
+      const QImage guide = randomImage(int(ceil(source.width() / factor)), int(ceil(source.height() / factor)), random);
+      const QImage result = ScaleDPID(source, guide, factor, sharpeningCurve);
+      for(int y = 0; y < result.height(); ++y)
+      {
+        const QRgb* line = (const QRgb*)result.constScanLine(y);
+        const QRgb* guideLine = (const QRgb*)guide.constScanLine(y);
+        for(int x = 0; x < result.width(); ++x)
+        {
+          const QRgb a = line[x];
+          const QRgb b = referencePixel(source, guideLine[x], x, y, factor, sharpeningCurve);
+          difference = qMax(difference, qMax(qMax(qAbs(qRed(a) - qRed(b)), qAbs(qGreen(a) - qGreen(b))),
+                                             qMax(qAbs(qBlue(a) - qBlue(b)), qAbs(qAlpha(a) - qAlpha(b)))));
+        }
+      }
+    }
+  }
+  return difference;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// Debug builds only. Largest channel difference between ScaleDPID, with its weight table,
+// AVX2 and fractional footprint kernels, and DPID computed per pixel with sqrt and pow over
+// random images, guides and factors. Should be at most 1.
+int DpidKernelSelfTest();
@@ -1,262 +1,2100 @@
 #include "filters.h"
 #include "avir.h"
+#include "simd.h"
+#include "threadpool.h"
+#ifdef SP_HAVE_SSE2
+#include "avir_float4_sse.h"
+#endif
+#ifdef SP_HAVE_AVX2
+#include <immintrin.h>
+#endif
 #include <cmath>
+#include <limits>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QThreadPool>
+#include <QVector>
 #include "Helpers/Angle.h"
 
 using namespace std;
 
-QImage ScaleAVIR(const QImage& input, float factor)
+namespace
 {
-  QImage converted;
-  if(input.format() != QImage::Format_ARGB32)
-    converted = input.convertToFormat(QImage::Format_ARGB32);
-  else
-    converted = input;
+  // Everything that decides how AVIR builds its filter steps for one resize.
+  struct AvirResizerKey
+  {
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+    int channels;
+    int pixelStride;
+    bool srgbGamma;
+    AvirQuality quality;
+    int buildMode;
 
-  uchar* src = converted.bits();
-  avir::CImageResizer<> ImageResizer(8, 0, avir::CImageResizerParamsLR());
+    bool operator==(const AvirResizerKey& other) const
+    {
+      return srcWidth == other.srcWidth && srcHeight == other.srcHeight &&
+             dstWidth == other.dstWidth && dstHeight == other.dstHeight &&
+             channels == other.channels && pixelStride == other.pixelStride &&
+             srgbGamma == other.srgbGamma && quality == other.quality &&
+             buildMode == other.buildMode;
+    }
+  };
 
-  int w = input.width();
-  int h = input.height();
-  int ow = w*factor;
-  int oh = h*factor;
+  struct AvirResizerEntry
+  {
+    explicit AvirResizerEntry(const AvirResizerKey& key) : key(key)
+    {}
 
-  QImage retVal(ow, oh, QImage::Format_ARGB32);
-  uchar* out = retVal.bits();
+    virtual ~AvirResizerEntry() = default;
 
-  avir::CImageResizerVars vars;
-  vars.UseSRGBGamma = true;
-  ImageResizer.resizeImage(src, w, h, 0,
-                           out, ow, oh, 4, 0, &vars);
-  return retVal;
+    virtual void resize(const uchar* src, int srcScanlineSize, uchar* dst, avir::CImageResizerVars* vars) = 0;
+
+    AvirResizerKey key;
+  };
+
+  // Sources with more pixels than this are resized in strips of output rows, so
+  // that AVIR's intermediate float buffers don't grow with the image height.
+  const qint64 AvirStripPixelThreshold = 4096 * 4096;
+  const int AvirStripHeight = 128;
+
+  avir::CImageResizerParams avirParams(AvirQuality quality)
+  {
+    switch(quality)
+    {
+    case AvirQuality::Low:
+      return avir::CImageResizerParamsLow();
+    case AvirQuality::Default:
+      return avir::CImageResizerParamsDef();
+    case AvirQuality::High:
+      return avir::CImageResizerParamsHigh();
+    case AvirQuality::Ultra:
+      return avir::CImageResizerParamsUltra();
+    default:
+      return avir::CImageResizerParamsLR();
+    }
+  }
+
+  // One resizer per floating point class: the scalar one, or the SSE one that
+  // keeps a whole pixel in a single register.
+  template<class fpclass>
+  struct AvirResizerEntryT : public AvirResizerEntry
+  {
+    explicit AvirResizerEntryT(const AvirResizerKey& key) : AvirResizerEntry(key), resizer(8, 0, avirParams(key.quality))
+    {}
+
+    void resize(const uchar* src, int srcScanlineSize, uchar* dst, avir::CImageResizerVars* vars) override
+    {
+      vars->ElIncrIO = key.pixelStride;
+      vars->BuildMode = key.buildMode < resizer.getBuildModeCount() ? key.buildMode : -1;
+      if(qint64(key.srcWidth) * key.srcHeight > AvirStripPixelThreshold)
+        resizer.resizeImageStrips(src, key.srcWidth, key.srcHeight, srcScanlineSize, dst, key.dstWidth, key.dstHeight,
+                                  key.channels, 0, AvirStripHeight, vars, &plan);
+      else
+        resizer.resizeImage(src, key.srcWidth, key.srcHeight, srcScanlineSize, dst, key.dstWidth, key.dstHeight,
+                            key.channels, 0, vars, &plan);
+    }
+
+    avir::CImageResizer<fpclass> resizer;
+    typename avir::CImageResizer<fpclass>::CPlan plan;
+  };
+
+  bool usesFloat4Resizer(int channels)
+  {
+#ifdef SP_HAVE_SSE2
+    return channels <= 4;
+#else
+    Q_UNUSED(channels);
+    return false;
+#endif
+  }
+
+  AvirResizerEntry* createAvirResizerEntry(const AvirResizerKey& key)
+  {
+#ifdef SP_HAVE_SSE2
+    if(usesFloat4Resizer(key.channels))
+      return new AvirResizerEntryT<avir::fpclass_float4>(key);
+#endif
+    return new AvirResizerEntryT<avir::fpclass_def<float>>(key);
+  }
+
+  // Keeps recently used resizers together with their filter steps and scratch buffers.
+  // Entries are taken out while in use, so concurrent resizes never share a plan.
+  class AvirResizerCache
+  {
+  public:
+    static const int Capacity = 4;
+
+    ~AvirResizerCache()
+    {
+      qDeleteAll(entries);
+    }
+
+    AvirResizerEntry* take(const AvirResizerKey& key)
+    {
+      QMutexLocker lock(&mutex);
+      for(int i = 0; i < entries.size(); ++i)
+      {
+        if(entries[i]->key == key)
+        {
+          stats.hits++;
+          AvirResizerEntry* entry = entries[i];
+          entries.removeAt(i);
+          return entry;
+        }
+      }
+      stats.misses++;
+      lock.unlock();
+      return createAvirResizerEntry(key);
+    }
+
+    void give(AvirResizerEntry* entry)
+    {
+      QMutexLocker lock(&mutex);
+      entries.prepend(entry);
+      while(entries.size() > Capacity)
+      {
+        delete entries.last();
+        entries.removeLast();
+      }
+    }
+
+    ResizerCacheStats statistics()
+    {
+      QMutexLocker lock(&mutex);
+      return stats;
+    }
+
+  private:
+    QMutex mutex;
+    QList<AvirResizerEntry*> entries;
+    ResizerCacheStats stats;
+  };
+
+  AvirResizerCache& avirResizerCache()
+  {
+    static AvirResizerCache cache;
+    return cache;
+  }
+
+  // Borrows a cache entry for the lifetime of the object.
+  class CachedAvirResizer
+  {
+  public:
+    explicit CachedAvirResizer(const AvirResizerKey& key) : entry(avirResizerCache().take(key))
+    {}
+
+    ~CachedAvirResizer()
+    {
+      avirResizerCache().give(entry);
+    }
+
+    AvirResizerEntry* operator->() const
+    {
+      return entry;
+    }
+
+  private:
+    AvirResizerEntry* entry;
+  };
 }
 
-QImage ScaleBilinear(const QImage& input, float factor)
+ResizerCacheStats AvirCacheStats()
 {
-  return input.scaled(input.width()*factor, input.height()*factor);
+  return avirResizerCache().statistics();
 }
 
 namespace
 {
-  struct KernelValue
+  // How a 32-bit format is laid out in memory. The resizers don't care about
+  // channel order, so these can be read and written without a conversion.
+  struct PixelLayout
   {
-    uchar r;
-    uchar g;
-    uchar b;
-    uchar a;
-    float w = 0.0f;
+    bool direct;        // false: convert to ARGB32 first
+    bool opaque;        // 3 colour bytes and an unused byte that must stay 255
+    bool premultiplied;
+    int colorOffset;    // byte offset of the colour channels of opaque formats
+    int alphaOffset;
+  };
 
-    KernelValue& operator=(QRgb val)
+  PixelLayout pixelLayout(QImage::Format format)
+  {
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    const int argbAlpha = 0;
+    const int rgb32Color = 1;
+#else
+    const int argbAlpha = 3;
+    const int rgb32Color = 0;
+#endif
+    switch(format)
     {
-      r = qRed(val);
-      g = qGreen(val);
-      b = qBlue(val);
-      a = qAlpha(val);
-      return *this;
+    case QImage::Format_ARGB32:
+      return {true, false, false, 0, argbAlpha};
+    case QImage::Format_ARGB32_Premultiplied:
+      return {true, false, true, 0, argbAlpha};
+    case QImage::Format_RGB32:
+      return {true, true, false, rgb32Color, argbAlpha};
+    case QImage::Format_RGBA8888:
+      return {true, false, false, 0, 3};
+    case QImage::Format_RGBA8888_Premultiplied:
+      return {true, false, true, 0, 3};
+    case QImage::Format_RGBX8888:
+      return {true, true, false, 0, 3};
+    default:
+      return {false, false, false, 0, argbAlpha};
     }
-    
-    virtual ~KernelValue()
-    {};
+  }
 
-    float distance(QRgb val)
+  // Tells whether every alpha byte is 255, stopping at the first row that isn't.
+  bool isOpaque(const QImage& image, int alphaOffset)
+  {
+    const int w = image.width();
+    for(int y = 0; y < image.height(); ++y)
     {
-      return sqrt(pow(qRed(val)-r, 2) + pow(qGreen(val)-g, 2) + pow(qBlue(val)-b, 2) + pow(qAlpha(val)-a, 2)) / 255.0f;
+      const uchar* line = image.constScanLine(y);
+      int x = 0;
+#ifdef SP_HAVE_SSE2
+      // Colour bytes are forced to 255, so an opaque run keeps all bits set
+      const __m128i colorMask = _mm_set1_epi32(int(~(0xffu << (alphaOffset * 8))));
+      __m128i all = _mm_set1_epi32(-1);
+      for(; x + 4 <= w; x += 4)
+        all = _mm_and_si128(all, _mm_or_si128(_mm_loadu_si128((const __m128i*)(line + x * 4)), colorMask));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(all, _mm_set1_epi32(-1))) != 0xffff)
+        return false;
+#endif
+      for(; x < w; ++x)
+        if(line[x * 4 + alphaOffset] != 255)
+          return false;
     }
+    return true;
+  }
+
+  // The resizers that filter in linear light can't take premultiplied colours as they
+  // are: converting them to ARGB32 un-premultiplies them first.
+  QImage linearLightSource(const QImage& input, PixelLayout* layout)
+  {
+    *layout = pixelLayout(input.format());
+    if(layout->direct && !layout->premultiplied)
+      return input;
+    *layout = pixelLayout(QImage::Format_ARGB32);
+    return input.convertToFormat(QImage::Format_ARGB32);
+  }
+
+  // Returns n if factor is exactly 1/n for an integer n > 1, otherwise 0.
+  int integerDownscaleFactor(float factor)
+  {
+    if(factor <= 0.0f || factor >= 1.0f)
+      return 0;
+    int n = qRound(1.0 / factor);
+    if(n > 1 && qAbs(double(factor) * n - 1.0) < 1e-6)
+      return n;
+    return 0;
+  }
+
+  const int LanczosLobes = 3;
+
+  double lanczos(double x)
+  {
+    if(x == 0.0)
+      return 1.0;
+    if(qAbs(x) >= LanczosLobes)
+      return 0.0;
+    double px = M_PI * x;
+    return LanczosLobes * sin(px) * sin(px / LanczosLobes) / (px * px);
+  }
+
+  // Box-prefiltered Lanczos3 kernel for downscaling by n. The source is summed
+  // into bins of n pixels, one per output pixel, and taps[LanczosLobes + k]
+  // weights the bin k positions away: the Lanczos3 weights of the source pixels
+  // in that bin, added up. Normalized to unit gain for bins of n pixels.
+  struct BinnedLanczosKernel
+  {
+    float taps[2 * LanczosLobes + 1];
   };
 
-  QRgb dpidKernel(const QImage& src, QRgb refColor, int startX, int startY, int width, int height, float sharpeningCurve)
+  BinnedLanczosKernel binnedLanczosKernel(int n)
+  {
+    static QMutex mutex;
+    static QHash<int, BinnedLanczosKernel> kernels;
+
+    QMutexLocker lock(&mutex);
+    if(kernels.contains(n))
+      return kernels.value(n);
+
+    double weights[2 * LanczosLobes + 1] = {};
+    double sum = 0.0;
+    for(int k = -LanczosLobes; k <= LanczosLobes; ++k)
+    {
+      for(int i = 0; i < n; ++i)
+        weights[LanczosLobes + k] += lanczos((k * n + i - (n - 1) * 0.5) / n);
+      sum += weights[LanczosLobes + k];
+    }
+
+    BinnedLanczosKernel kernel;
+    for(int k = 0; k < 2 * LanczosLobes + 1; ++k)
+      kernel.taps[k] = weights[k] / (sum * n);
+
+    kernels.insert(n, kernel);
+    return kernel;
+  }
+
+  const int LanczosRowsPerChunk = 4;
+
+  // Separable Lanczos3 downscale by an integer factor in linear light, the fast
+  // path of ScaleAVIR. Each bin row first sums n source rows, then sums every n
+  // pixels of that into a bin and applies the 7 kernel taps at the output rate,
+  // so the cost per source pixel is a table lookup and an add. The vertical pass
+  // then applies the taps to the bin rows. Bins beyond the image edges repeat the
+  // edge bins.
+  QImage downscaleLanczos(const QImage& input, int n, int ow, int oh)
+  {
+    PixelLayout layout;
+    const QImage src = linearLightSource(input, &layout);
+
+    const BinnedLanczosKernel kernel = binnedLanczosKernel(n);
+    const float* taps = kernel.taps;
+    const float* toLinear = avir::CSRGBGammaTables<float>::getSRGB2Lin8();
+    const int tapCount = 2 * LanczosLobes + 1;
+    const int rowSize = ow * 4;
+
+    // Horizontally filtered bin rows of the whole output
+    QVector<float> binRows(oh * rowSize);
+
+    ParallelFor(oh, LanczosRowsPerChunk, [&](int begin, int end)
+    {
+      QVector<float> columns(ow * n * 4);
+      // Horizontal bins of one bin row, padded on both sides
+      QVector<float> bins((ow + 2 * LanczosLobes) * 4);
+
+      for(int by = begin; by < end; ++by)
+      {
+        float* c = columns.data();
+        for(int i = 0; i < ow * n * 4; ++i)
+          c[i] = 0.0f;
+        for(int r = 0; r < n; ++r)
+        {
+          const uchar* line = src.constScanLine(by * n + r);
+          for(int i = 0; i < ow * n * 4; ++i)
+            c[i] += toLinear[line[i]];
+        }
+
+        float* b = bins.data() + LanczosLobes * 4;
+        for(int x = 0; x < ow; ++x, c += n * 4)
+        {
+          float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+          for(int i = 0; i < n * 4; i += 4)
+          {
+            sum[0] += c[i + 0];
+            sum[1] += c[i + 1];
+            sum[2] += c[i + 2];
+            sum[3] += c[i + 3];
+          }
+          for(int k = 0; k < 4; ++k)
+            b[x * 4 + k] = sum[k];
+        }
+        for(int k = 1; k <= LanczosLobes; ++k)
+        {
+          for(int ch = 0; ch < 4; ++ch)
+          {
+            b[-k * 4 + ch] = b[ch];
+            b[(ow - 1 + k) * 4 + ch] = b[(ow - 1) * 4 + ch];
+          }
+        }
+
+        // One pixel is 4 floats, a single SSE register.
+        const float* in = bins.constData();
+        float* out = binRows.data() + by * rowSize;
+        for(int x = 0; x < ow; ++x, in += 4)
+        {
+#ifdef SP_HAVE_SSE2
+          avir::float4 acc(0.0f);
+          for(int t = 0; t < tapCount; ++t)
+            acc += avir::float4(taps[t]) * avir::float4::loadu(in + t * 4);
+          acc.storeu(out + x * 4);
+#else
+          for(int ch = 0; ch < 4; ++ch)
+          {
+            float acc = 0.0f;
+            for(int t = 0; t < tapCount; ++t)
+              acc += taps[t] * in[t * 4 + ch];
+            out[x * 4 + ch] = acc;
+          }
+#endif
+        }
+      }
+    });
+
+    QImage retVal(ow, oh, src.format());
+
+    ParallelFor(oh, LanczosRowsPerChunk, [&](int begin, int end)
+    {
+      const float* rows[2 * LanczosLobes + 1];
+      QVector<float> acc(rowSize);
+
+      for(int y = begin; y < end; ++y)
+      {
+        for(int t = 0; t < tapCount; ++t)
+          rows[t] = binRows.constData() + qBound(0, y - LanczosLobes + t, oh - 1) * rowSize;
+
+        float* a = acc.data();
+        for(int i = 0; i < rowSize; i += 4)
+        {
+#ifdef SP_HAVE_SSE2
+          avir::float4 sum(0.0f);
+          for(int t = 0; t < tapCount; ++t)
+            sum += avir::float4(taps[t]) * avir::float4::loadu(rows[t] + i);
+          avir::clamp(sum, 0.0f, 1.0f).storeu(a + i);
+#else
+          for(int ch = 0; ch < 4; ++ch)
+          {
+            float sum = 0.0f;
+            for(int t = 0; t < tapCount; ++t)
+              sum += taps[t] * rows[t][i + ch];
+            a[i + ch] = qBound(0.0f, sum, 1.0f);
+          }
+#endif
+        }
+
+        uchar* out = retVal.scanLine(y);
+        for(int i = 0; i < rowSize; ++i)
+          out[i] = uchar(avir::CSRGBGammaTables<float>::convertLin2SRGB(a[i]) * 255.0f + 0.5f);
+      }
+    });
+    return retVal;
+  }
+
+  // Box (area average) downscale by an integer factor, the fast path of
+  // ScaleBilinear. Sums are exact integers, rounded once at the end.
+  QImage downscaleBox(const QImage& input, int n, int ow, int oh)
   {
-    KernelValue values[512];
-    float refWeight = 0.01;
-    float cumWeight = refWeight;
-    int curIndex = 0;
+    QImage src = pixelLayout(input.format()).direct ? input : input.convertToFormat(QImage::Format_ARGB32);
+    const quint32 area = n * n;
 
-    for(int y = startY; y < startY + height; y++)
+    QImage retVal(ow, oh, src.format());
+    QVector<quint32> sums(ow * 4);
+
+    for(int y = 0; y < oh; ++y)
     {
-      for(int x = startX; x < startX + width; x++)
-      {        
-        if(y > 0 && y < src.height() && x > 0 && x < src.width())
+      quint32* s = sums.data();
+      for(int i = 0; i < ow * 4; ++i)
+        s[i] = 0;
+      for(int r = 0; r < n; ++r)
+      {
+        const uchar* line = src.constScanLine(y * n + r);
+        for(int x = 0; x < ow; ++x)
         {
-          KernelValue& val = values[curIndex++];
-          val   = src.pixel(x, y);
-          val.w = pow(val.distance(refColor), sharpeningCurve);
-          cumWeight += val.w;
+          for(int k = 0; k < n; ++k, line += 4)
+          {
+            s[x * 4 + 0] += line[0];
+            s[x * 4 + 1] += line[1];
+            s[x * 4 + 2] += line[2];
+            s[x * 4 + 3] += line[3];
+          }
         }
       }
+
+      uchar* out = retVal.scanLine(y);
+      for(int i = 0; i < ow * 4; ++i)
+        out[i] = uchar((s[i] + area / 2) / area);
     }
+    return retVal;
+  }
 
-    double red   = qRed(refColor)*refWeight;
-    double green = qGreen(refColor)*refWeight;
-    double blue  = qBlue(refColor)*refWeight;
-    double alpha = qAlpha(refColor)*refWeight;
+  const int AutotuneRuns = 3;
 
-    for(int i = 0; i < curIndex; i++)
+  // The AVIR resize proper, without the integer factor fast path
+  QImage resizeAvir(const QImage& input, int ow, int oh, AvirQuality quality, int buildMode)
+  {
+    // Straight alpha 32-bit layouts are resized in place, anything else goes through ARGB32
+    PixelLayout layout;
+    const QImage converted = linearLightSource(input, &layout);
+
+    // Opaque sources skip the constant alpha channel, the output fill restores it. The SSE
+    // resizer keeps a pixel in one register whatever its channel count, so it isn't worth a scan.
+    if(!layout.opaque && !usesFloat4Resizer(4) && isOpaque(converted, layout.alphaOffset))
     {
-      KernelValue& val = values[i];
-      red   += val.r * val.w;
-      green += val.g * val.w;
-      blue  += val.b * val.w;
-      alpha += val.a * val.w;
+      layout.opaque = true;
+      layout.colorOffset = layout.alphaOffset == 0 ? 1 : 0;
     }
+    const int channels = layout.opaque ? 3 : 4;
 
-    red   /= cumWeight;
-    green /= cumWeight;
-    blue  /= cumWeight;
-    alpha /= cumWeight;
+    int w = input.width();
+    int h = input.height();
 
-    return qRgba(red, green, blue, alpha);
+    QImage retVal(ow, oh, converted.format());
+    if(layout.opaque)
+      retVal.fill(0xffffffff);
+
+    const uchar* src = converted.constBits() + layout.colorOffset;
+    uchar* out = retVal.bits() + layout.colorOffset;
+
+    AvirThreadPool threadPool;
+    avir::CImageResizerVars vars;
+    vars.UseSRGBGamma = true;
+    vars.ThreadPool = &threadPool;
+
+    CachedAvirResizer cached({w, h, ow, oh, channels, 4, vars.UseSRGBGamma, quality, buildMode});
+    cached->resize(src, converted.bytesPerLine(), out, &vars);
+    return retVal;
   }
 }
 
-QImage ScaleDPID(const QImage& src, int pixelFactor, float sharpeningCurve)
+bool AvirFastPathApplies(float factor, AvirQuality quality)
 {
-  // Implementation of "Rapid, Detail-Preserving Image Downscaling"-Research paper by Nicolas Weber et al from 2016
-  QImage reference = ScaleAVIR(src, 1.0f/pixelFactor);
+  // The fast path stands in for the default preset, an explicit preset or build mode gets AVIR
+  return quality == AvirQuality::LR && integerDownscaleFactor(factor) > 0;
+}
 
-  QImage retVal(reference.width(), reference.height(), QImage::Format_ARGB32);
-  for(int y = 0; y < retVal.height(); ++y)
+QImage ScaleAVIR(const QImage& input, float factor, AvirQuality quality, int buildMode)
+{
+  if(AvirFastPathApplies(factor, quality) && buildMode < 0)
   {
-    QRgb* line = (QRgb*)retVal.scanLine(y);
-    QRgb* refLine = (QRgb*)reference.scanLine(y);
-    for(int x = 0; x < retVal.width(); ++x)
-      //line[x] = qRgb(255, 0, 0);
-      line[x] = dpidKernel(src, refLine[x], x*pixelFactor, y*pixelFactor, pixelFactor, pixelFactor, sharpeningCurve);
+    int n = integerDownscaleFactor(factor);
+    int ow = qMin(int(input.width()*factor), input.width() / n);
+    int oh = qMin(int(input.height()*factor), input.height() / n);
+    if(ow > 0 && oh > 0)
+      return downscaleLanczos(input, n, ow, oh);
   }
-  qDebug("%d %d", retVal.width(), retVal.height());
-  return retVal;
+
+  return resizeAvir(input, input.width()*factor, input.height()*factor, quality, buildMode);
 }
 
-QImage AlphaThreshold(const QImage& input, float threshold)
+int AvirBuildModeCount(AvirQuality quality)
 {
-  QImage retVal(input.convertToFormat(QImage::Format_ARGB32));
-  for(int y = 0; y < retVal.height(); ++y)
+  return avir::CImageResizer<>(8, 0, avirParams(quality)).getBuildModeCount();
+}
+
+int AutotuneAvirBuildMode(const QImage& input, float factor, AvirQuality quality, int tolerance)
+{
+  const int ow = input.width()*factor;
+  const int oh = input.height()*factor;
+  const QImage reference = resizeAvir(input, ow, oh, quality, -1).convertToFormat(QImage::Format_ARGB32);
+
+  int bestMode = -1;
+  qint64 bestTime = std::numeric_limits<qint64>::max();
+  for(int mode = 0; mode < AvirBuildModeCount(quality); ++mode)
   {
-    uchar* line = retVal.scanLine(y);
-    for(int x = 0; x < retVal.width(); ++x)
+    // The first run builds the plan, the timed runs reuse it as a batch would
+    const QImage result = resizeAvir(input, ow, oh, quality, mode).convertToFormat(QImage::Format_ARGB32);
+    int difference = 0;
+    for(int y = 0; y < oh; ++y)
     {
-      float alpha = line[x*4+3] / 255.0;
-      if(alpha > threshold)
-        line[x*4+3] = 255;
-      else
-      {
-        line[x*4+0] = 0;
-        line[x*4+1] = 0;
-        line[x*4+2] = 0;
-        line[x*4+3] = 0;
-      }
+      const uchar* line = result.constScanLine(y);
+      const uchar* refLine = reference.constScanLine(y);
+      for(int i = 0; i < ow * 4; ++i)
+        difference = qMax(difference, qAbs(line[i] - refLine[i]));
+    }
+    if(difference > tolerance)
+      continue;
+
+    qint64 time = std::numeric_limits<qint64>::max();
+    for(int run = 0; run < AutotuneRuns; ++run)
+    {
+      QElapsedTimer timer;
+      timer.start();
+      resizeAvir(input, ow, oh, quality, mode);
+      time = qMin(time, timer.nsecsElapsed());
+    }
+    if(time < bestTime)
+    {
+      bestTime = time;
+      bestMode = mode;
     }
   }
-  return retVal;
+  return bestMode;
 }
 
-namespace
+QImage ScaleBilinear(const QImage& input, float factor)
 {
-  float getLuminance(QRgb val)
+  int n = integerDownscaleFactor(factor);
+  if(n > 0)
   {
-    return 0.2126 * (qRed(val)/255.0) + 0.7152 * (qGreen(val)/255.0) + 0.0722 * (qBlue(val)/255.0);
+    int ow = qMin(int(input.width()*factor), input.width() / n);
+    int oh = qMin(int(input.height()*factor), input.height() / n);
+    if(ow > 0 && oh > 0)
+      return downscaleBox(input, n, ow, oh);
   }
 
-  template<typename T>
-  T interpolateLinear(T start, T end, float factor)
+  return input.scaled(input.width()*factor, input.height()*factor);
+}
+
+namespace
+{
+  const int BoxGuideRowsPerChunk = 16;
+
+  // Source pixels [first, last) nearest the footprint of output pixel i along an axis
+  void boxSpan(int i, double scale, int srcSize, int* first, int* last)
   {
-    return start + (end - start) * factor;
-  };
+    *first = qMin(int(i * scale + 0.5), srcSize - 1);
+    *last = qMax(*first + 1, qMin(int((i + 1) * scale + 0.5), srcSize));
+  }
 
-  template<typename T>
-  T interpolateLinear(T start, T end, float startT, float endT, float time)
+  // Rounded box averages of output row y, 4 channels a pixel. The band of source rows
+  // is summed into columns first, which has room for one ARGB32 source row.
+  void boxAverageRow(const QImage& src, int y, int ow, double scaleX, double scaleY, quint32* columns, quint32* out)
   {
-    return interpolateLinear(start, end, (time-startT)/(endT-startT));
-  };
+    const int w = src.width();
+    int y0, y1;
+    boxSpan(y, scaleY, src.height(), &y0, &y1);
 
+    for(int i = 0; i < w * 4; ++i)
+      columns[i] = 0;
+    for(int r = y0; r < y1; ++r)
+    {
+      const uchar* line = src.constScanLine(r);
+      for(int i = 0; i < w * 4; ++i)
+        columns[i] += line[i];
+    }
 
-  float applyMapping(float value, float start, float mid, float end, float midp=0.5f)
+    for(int x = 0; x < ow; ++x)
+    {
+      int x0, x1;
+      boxSpan(x, scaleX, w, &x0, &x1);
+      quint64 sum[4] = {0, 0, 0, 0};
+      for(int s = x0; s < x1; ++s)
+        for(int c = 0; c < 4; ++c)
+          sum[c] += columns[s * 4 + c];
+      const quint64 area = quint64(x1 - x0) * (y1 - y0);
+      for(int c = 0; c < 4; ++c)
+        out[x * 4 + c] = quint32((sum[c] + area / 2) / area);
+    }
+  }
+
+  const int DpidRowsPerChunk = 4;
+  const float DpidRefWeight = 0.01f;
+
+  // Squared RGBA distances between two colours run from 0 to 4*255^2
+  const int DpidMaxSquaredDistance = 4 * 255 * 255;
+  const int DpidWeightTableCapacity = 4;
+
+  // pow(distance, sharpeningCurve) for every squared distance, so the kernel does a
+  // lookup per pixel instead of sqrt and pow. Each table is about 1 MB.
+  QVector<float> dpidWeightTable(float sharpeningCurve)
   {
-    if(value < start)
-      return 0.0f;
-    if(value > end)
-      return 1.0f;
+    static QMutex mutex;
+    static QHash<float, QVector<float>> tables;
 
-    if(value < mid)
-      return interpolateLinear(0.0f, midp, start, mid, value);
-    else
-      return interpolateLinear(midp, 1.0f, mid, end, value);
+    QMutexLocker lock(&mutex);
+    if(tables.contains(sharpeningCurve))
+      return tables.value(sharpeningCurve);
+
+    QVector<float> table(DpidMaxSquaredDistance + 1);
+    float* weights = table.data();
+    ParallelFor(table.size(), 16384, [&](int begin, int end)
+    {
+      for(int i = begin; i < end; ++i)
+      {
+        const float distance = sqrt(double(i)) / 255.0f;
+        weights[i] = pow(distance, sharpeningCurve);
+      }
+    });
+
+    if(tables.size() >= DpidWeightTableCapacity)
+      tables.clear();
+    tables.insert(sharpeningCurve, table);
+    return table;
   }
 
-  float barycentricInterpolation(float px, float py, float x1, float y1, float v1, float x2, float y2, float v2, float x3, float y3, float v3)
+  int squaredDistance(QRgb a, QRgb b)
   {
-    float div = ((y2-y3)*(x1-x3) + (x3-x2)*(y1-y3));
-    float w1 = ((y2-y3)*(px-x3) + (x3-x2)*(py-y3)) / div;
-    float w2 = ((y3-y1)*(px-x3) + (x1-x3)*(py-y3)) / div;
-    float w3 = 1 - w1 - w2;
-    return v1*w1 + v2*w2 + v3*w3;
+    const int dr = qRed(a) - qRed(b);
+    const int dg = qGreen(a) - qGreen(b);
+    const int db = qBlue(a) - qBlue(b);
+    const int da = qAlpha(a) - qAlpha(b);
+    return dr*dr + dg*dg + db*db + da*da;
   }
-}
-
-QImage NormalizedGrayscale(const QImage& input, float blackPoint, float midPoint, float whitePoint)
-{
-  QImage retVal(input.convertToFormat(QImage::Format_ARGB32));
-  QList<float> bucketL;
-  bucketL.reserve(input.width()*input.height());
 
-  for(int y = 0; y < retVal.height(); ++y)
+  // Weighs each source pixel of one output pixel's footprint by its distance to the
+  // guide colour. Weights and colour sums are accumulated in one pass over the rows.
+  QRgb dpidKernel(const QImage& src, QRgb refColor, int startX, int startY, int width, int height, const float* weights)
   {
-    QRgb* line = (QRgb*)retVal.scanLine(y);
-    for(int x = 0; x < retVal.width(); ++x)
+    float cumWeight = DpidRefWeight;
+    double red   = qRed(refColor)*DpidRefWeight;
+    double green = qGreen(refColor)*DpidRefWeight;
+    double blue  = qBlue(refColor)*DpidRefWeight;
+    double alpha = qAlpha(refColor)*DpidRefWeight;
+
+    const int endX = qMin(startX + width, src.width());
+    const int endY = qMin(startY + height, src.height());
+    for(int y = qMax(startY, 0); y < endY; y++)
     {
-      const QRgb& pixel = line[x];
-      if(qAlpha(pixel) > 64)
-        bucketL.push_back(getLuminance(pixel));
+      const QRgb* line = (const QRgb*)src.constScanLine(y);
+      for(int x = qMax(startX, 0); x < endX; x++)
+      {
+        const QRgb val = line[x];
+        const float w = weights[squaredDistance(val, refColor)];
+
+        cumWeight += w;
+        red   += qRed(val) * w;
+        green += qGreen(val) * w;
+        blue  += qBlue(val) * w;
+        alpha += qAlpha(val) * w;
+      }
     }
-  }
 
-  qSort(bucketL);
-  float minL = bucketL[bucketL.length()*blackPoint];
-  float medianL = bucketL[bucketL.length()*midPoint];
-  float maxL = bucketL[(bucketL.length()-1)*whitePoint];
+    red   /= cumWeight;
+    green /= cumWeight;
+    blue  /= cumWeight;
+    alpha /= cumWeight;
+
+    return qRgba(red, green, blue, alpha);
+  }
 
-  for(int y = 0; y < retVal.height(); ++y)
+#ifdef SP_HAVE_AVX2
+  // dpidKernel for footprints that lie inside the image, 8 pixels at a time. The
+  // pixels are gathered through offsets from the top left of the block, so any
+  // block size works. Lanes are summed separately, which can move the result by 1.
+  SP_TARGET_AVX2 QRgb dpidKernelAVX2(const QRgb* block, const int* offsets, int count, QRgb refColor, const float* weights)
   {
-    uchar* line = retVal.scanLine(y);
-    for(int x = 0; x < retVal.width(); ++x)
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i refRed   = _mm256_set1_epi32(qRed(refColor));
+    const __m256i refGreen = _mm256_set1_epi32(qGreen(refColor));
+    const __m256i refBlue  = _mm256_set1_epi32(qBlue(refColor));
+    const __m256i refAlpha = _mm256_set1_epi32(qAlpha(refColor));
+
+    __m256 sumWeight = _mm256_setzero_ps();
+    __m256 sumRed    = _mm256_setzero_ps();
+    __m256 sumGreen  = _mm256_setzero_ps();
+    __m256 sumBlue   = _mm256_setzero_ps();
+    __m256 sumAlpha  = _mm256_setzero_ps();
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
     {
-      QRgb* pixel = (QRgb*)&line[x*4];
-      float luminance = getLuminance(*pixel);
-      float normalized = applyMapping(luminance, minL, medianL, maxL);
-      uchar byteV = normalized*255;
-      QColor col;
-      col.setRgba(*pixel);
-      col = col.convertTo(QColor::Hsl);
-      col.setHsl(col.hue(), col.hslSaturation(), byteV);
-      col = col.convertTo(QColor::Rgb);
-      line[x*4+0] = col.red();
-      line[x*4+1] = col.green();
-      line[x*4+2] = col.blue();
+      const __m256i index = _mm256_loadu_si256((const __m256i*)(offsets + i));
+      const __m256i pixels = _mm256_i32gather_epi32((const int*)block, index, 4);
+      const __m256i b = _mm256_and_si256(pixels, byteMask);
+      const __m256i g = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byteMask);
+      const __m256i r = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), byteMask);
+      const __m256i a = _mm256_srli_epi32(pixels, 24);
+
+      const __m256i dr = _mm256_sub_epi32(r, refRed);
+      const __m256i dg = _mm256_sub_epi32(g, refGreen);
+      const __m256i db = _mm256_sub_epi32(b, refBlue);
+      const __m256i da = _mm256_sub_epi32(a, refAlpha);
+      const __m256i distance = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)),
+                                                _mm256_add_epi32(_mm256_mullo_epi32(db, db), _mm256_mullo_epi32(da, da)));
+      const __m256 w = _mm256_i32gather_ps(weights, distance, 4);
+
+      sumWeight = _mm256_add_ps(sumWeight, w);
+      sumRed    = _mm256_add_ps(sumRed, _mm256_mul_ps(_mm256_cvtepi32_ps(r), w));
+      sumGreen  = _mm256_add_ps(sumGreen, _mm256_mul_ps(_mm256_cvtepi32_ps(g), w));
+      sumBlue   = _mm256_add_ps(sumBlue, _mm256_mul_ps(_mm256_cvtepi32_ps(b), w));
+      sumAlpha  = _mm256_add_ps(sumAlpha, _mm256_mul_ps(_mm256_cvtepi32_ps(a), w));
+    }
+
+    float lanes[5][8];
+    _mm256_storeu_ps(lanes[0], sumWeight);
+    _mm256_storeu_ps(lanes[1], sumRed);
+    _mm256_storeu_ps(lanes[2], sumGreen);
+    _mm256_storeu_ps(lanes[3], sumBlue);
+    _mm256_storeu_ps(lanes[4], sumAlpha);
+
+    float cumWeight = DpidRefWeight;
+    double red   = qRed(refColor)*DpidRefWeight;
+    double green = qGreen(refColor)*DpidRefWeight;
+    double blue  = qBlue(refColor)*DpidRefWeight;
+    double alpha = qAlpha(refColor)*DpidRefWeight;
+    for(int lane = 0; lane < 8; ++lane)
+    {
+      cumWeight += lanes[0][lane];
+      red   += lanes[1][lane];
+      green += lanes[2][lane];
+      blue  += lanes[3][lane];
+      alpha += lanes[4][lane];
     }
+
+    for(; i < count; ++i)
+    {
+      const QRgb val = block[offsets[i]];
+      const float w = weights[squaredDistance(val, refColor)];
+
+      cumWeight += w;
+      red   += qRed(val) * w;
+      green += qGreen(val) * w;
+      blue  += qBlue(val) * w;
+      alpha += qAlpha(val) * w;
+    }
+
+    red   /= cumWeight;
+    green /= cumWeight;
+    blue  /= cumWeight;
+    alpha /= cumWeight;
+
+    return qRgba(red, green, blue, alpha);
   }
-  return retVal;
-}
+#endif
 
-QImage Posterize(const QImage& input, int stepsL, int stepsH)
-{
-  int stepSizeL = 255 / stepsL;
-  int stepSizeH = 255 / stepsH;
-  QImage retVal(input.convertToFormat(QImage::Format_ARGB32));
-  for(int y = 0; y < retVal.height(); ++y)
+  // Source pixels covered by one output pixel along an axis. Output pixel i covers
+  // [i*scale, (i+1)*scale), so the first and last source pixels may be partly covered.
+  struct DpidSpan
+  {
+    int first;
+    int count;
+    int coverage;   // index of the first pixel's coverage in the coverage list
+  };
+
+  QVector<DpidSpan> dpidSpans(int outSize, int srcSize, double scale, QVector<float>& coverage)
   {
-    uchar* line = retVal.scanLine(y);
-    for(int x = 0; x < retVal.width(); ++x)
+    QVector<DpidSpan> spans(outSize);
+    for(int i = 0; i < outSize; ++i)
     {
-      uchar l = qMax(qMax(line[x*4+0], line[x*4+1]), line[x*4+2]);
-      uchar byteV = l/stepSizeL*stepSizeL;
-      QColor col;
-      col.setRgba((reinterpret_cast<QRgb*>(line))[x]);
-      col = col.convertTo(QColor::Hsl);
-      col.setHsl(col.hue()/stepSizeH*stepSizeH, (col.hslSaturation()<20?0:40), byteV);
-      col = col.convertTo(QColor::Rgb);
-      line[x*4+0] = col.red();
-      line[x*4+1] = col.green();
-      line[x*4+2] = col.blue();
+      const double begin = i * scale;
+      const double end = qMin((i + 1) * scale, double(srcSize));
+      const int first = qMin(int(floor(begin)), srcSize - 1);
+      const int last = qMax(first + 1, qMin(int(ceil(end)), srcSize));
+
+      spans[i] = {first, last - first, int(coverage.size())};
+      for(int s = first; s < last; ++s)
+        coverage.append(float(qMax(0.0, qMin(s + 1.0, end) - qMax(double(s), begin))));
     }
+    return spans;
   }
+
+  // dpidKernel for footprints of any size, with each weight scaled by the covered
+  // part of its source pixel.
+  QRgb dpidKernelFractional(const QImage& src, QRgb refColor, const DpidSpan& spanX, const DpidSpan& spanY,
+                            const float* coverage, const float* weights)
+  {
+    float cumWeight = DpidRefWeight;
+    double red   = qRed(refColor)*DpidRefWeight;
+    double green = qGreen(refColor)*DpidRefWeight;
+    double blue  = qBlue(refColor)*DpidRefWeight;
+    double alpha = qAlpha(refColor)*DpidRefWeight;
+
+    for(int j = 0; j < spanY.count; j++)
+    {
+      const QRgb* line = (const QRgb*)src.constScanLine(spanY.first + j) + spanX.first;
+      const float coverageY = coverage[spanY.coverage + j];
+      for(int i = 0; i < spanX.count; i++)
+      {
+        const QRgb val = line[i];
+        const float w = weights[squaredDistance(val, refColor)] * coverage[spanX.coverage + i] * coverageY;
+
+        cumWeight += w;
+        red   += qRed(val) * w;
+        green += qGreen(val) * w;
+        blue  += qBlue(val) * w;
+        alpha += qAlpha(val) * w;
+      }
+    }
+
+    red   /= cumWeight;
+    green /= cumWeight;
+    blue  /= cumWeight;
+    alpha /= cumWeight;
+
+    return qRgba(red, green, blue, alpha);
+  }
+
+  // Implementation of "Rapid, Detail-Preserving Image Downscaling"-Research paper by Nicolas Weber et al from 2016.
+  // Every output pixel covers scaleX by scaleY source pixels; whole pixel footprints take the integer kernels.
+  QImage scaleDPID(const QImage& src, const QImage& guide, double scaleX, double scaleY, float sharpeningCurve)
+  {
+    // The kernel reads both images as ARGB32 scanlines, the scaled guide keeps the source format
+    const QImage source = src.convertToFormat(QImage::Format_ARGB32);
+    const QImage reference = guide.convertToFormat(QImage::Format_ARGB32);
+    QImage retVal(reference.width(), reference.height(), QImage::Format_ARGB32);
+    uchar* bits = retVal.bits();
+    const int bytesPerLine = retVal.bytesPerLine();
+
+    const QVector<float> weightTable = dpidWeightTable(sharpeningCurve);
+    const float* weights = weightTable.constData();
+
+    const int pixelFactor = int(scaleX);
+    if(scaleX != pixelFactor || scaleY != pixelFactor)
+    {
+      QVector<float> coverage;
+      const QVector<DpidSpan> spansX = dpidSpans(retVal.width(), source.width(), scaleX, coverage);
+      const QVector<DpidSpan> spansY = dpidSpans(retVal.height(), source.height(), scaleY, coverage);
+
+      ParallelFor(retVal.height(), DpidRowsPerChunk, [&](int begin, int end)
+      {
+        for(int y = begin; y < end; ++y)
+        {
+          QRgb* line = (QRgb*)(bits + y * bytesPerLine);
+          const QRgb* refLine = (const QRgb*)reference.constScanLine(y);
+          for(int x = 0; x < retVal.width(); ++x)
+            line[x] = dpidKernelFractional(source, refLine[x], spansX[x], spansY[y], coverage.constData(), weights);
+        }
+      });
+      return retVal;
+    }
+
+#ifdef SP_HAVE_AVX2
+    // Offsets of the footprint pixels from its top left corner, in pixels
+    const bool useAVX2 = CpuHasAVX2();
+    const int sourceStride = source.bytesPerLine() / 4;
+    QVector<int> offsets;
+    for(int y = 0; y < pixelFactor; ++y)
+      for(int x = 0; x < pixelFactor; ++x)
+        offsets.append(y * sourceStride + x);
+#endif
+
+    // Every output pixel only reads its own source block, so rows can be done in any order
+    ParallelFor(retVal.height(), DpidRowsPerChunk, [&](int begin, int end)
+    {
+      for(int y = begin; y < end; ++y)
+      {
+        QRgb* line = (QRgb*)(bits + y * bytesPerLine);
+        const QRgb* refLine = (const QRgb*)reference.constScanLine(y);
+        int x = 0;
+#ifdef SP_HAVE_AVX2
+        if(useAVX2 && (y + 1) * pixelFactor <= source.height())
+        {
+          const QRgb* sourceLine = (const QRgb*)source.constScanLine(y * pixelFactor);
+          for(; x < retVal.width() && (x + 1) * pixelFactor <= source.width(); ++x)
+            line[x] = dpidKernelAVX2(sourceLine + x * pixelFactor, offsets.constData(), offsets.size(), refLine[x], weights);
+        }
+#endif
+        for(; x < retVal.width(); ++x)
+          line[x] = dpidKernel(source, refLine[x], x*pixelFactor, y*pixelFactor, pixelFactor, pixelFactor, weights);
+      }
+    });
+    return retVal;
+  }
+}
+
+QImage ScaleDPID(const QImage& src, int pixelFactor, float sharpeningCurve)
+{
+  return ScaleDPID(src, ScaleAVIR(src, 1.0f/pixelFactor), pixelFactor, sharpeningCurve);
+}
+
+QImage ScaleDPID(const QImage& src, const QImage& guide, float pixelFactor, float sharpeningCurve)
+{
+  return scaleDPID(src, guide, pixelFactor, pixelFactor, sharpeningCurve);
+}
+
+QImage ScaleDPID(const QImage& src, const QSize& size, float sharpeningCurve)
+{
+  return ScaleDPID(src, size, resizeAvir(src, size.width(), size.height(), AvirQuality::LR, -1), sharpeningCurve);
+}
+
+QImage ScaleDPID(const QImage& src, const QSize& size, const QImage& guide, float sharpeningCurve)
+{
+  return scaleDPID(src, guide, double(src.width()) / size.width(), double(src.height()) / size.height(), sharpeningCurve);
+}
+
+QImage DpidBoxGuide(const QImage& input, const QSize& size)
+{
+  // The paper's cheap guide: box averages, then a 3x3 [1 2 1] smoothing. Each chunk of rows
+  // computes the box rows it smooths, one more on each side, so no image-sized table is kept.
+  const QImage src = input.convertToFormat(QImage::Format_ARGB32);
+  const int ow = size.width();
+  const int oh = size.height();
+  const double scaleX = double(src.width()) / ow;
+  const double scaleY = double(src.height()) / oh;
+
+  QImage retVal(ow, oh, QImage::Format_ARGB32);
+  uchar* bits = retVal.bits();
+  const int bytesPerLine = retVal.bytesPerLine();
+  ParallelFor(oh, BoxGuideRowsPerChunk, [&](int begin, int end)
+  {
+    const int first = qMax(begin - 1, 0);
+    const int last = qMin(end, oh - 1);
+    QVector<quint32> columns(src.width() * 4);
+    QVector<quint32> box((last - first + 1) * ow * 4);
+    for(int y = first; y <= last; ++y)
+      boxAverageRow(src, y, ow, scaleX, scaleY, columns.data(), box.data() + (y - first) * ow * 4);
+
+    for(int y = begin; y < end; ++y)
+    {
+      const quint32* rows[3] = {box.constData() + (qMax(y - 1, 0) - first) * ow * 4,
+                                box.constData() + (y - first) * ow * 4,
+                                box.constData() + (qMin(y + 1, oh - 1) - first) * ow * 4};
+      uchar* line = bits + y * bytesPerLine;
+      for(int x = 0; x < ow; ++x)
+      {
+        const int left = qMax(x - 1, 0) * 4;
+        const int right = qMin(x + 1, ow - 1) * 4;
+        for(int c = 0; c < 4; ++c)
+        {
+          quint32 sum = 0;
+          for(int r = 0; r < 3; ++r)
+          {
+            const quint32 rowWeight = r == 1 ? 2 : 1;
+            sum += rowWeight * (rows[r][left + c] + 2 * rows[r][x * 4 + c] + rows[r][right + c]);
+          }
+          line[x * 4 + c] = uchar((sum + 8) / 16);
+        }
+      }
+    }
+  });
+  return retVal;
+}
+
+float ComposedScaleFactor(int width, int height, int maxInputSize, int downscaleFactor)
+{
+  // Folds the input size limit into the downscale, so both take a single resample
+  int longSide = qMax(width, height);
+  float factor = 1.0f / downscaleFactor;
+  if(maxInputSize > 0 && longSide > maxInputSize)
+    factor *= float(maxInputSize) / float(longSide);
+  return factor;
+}
+
+namespace
+{
+  const int AlphaThresholdRowsPerChunk = 64;
+
+  // Smallest alpha that passes alpha / 255.0 > threshold, 256 if none does
+  int alphaThresholdByte(float threshold)
+  {
+    int minAlpha = 0;
+    while(minAlpha < 256 && !(float(minAlpha / 255.0) > threshold))
+      ++minAlpha;
+    return minAlpha;
+  }
+
+  // Makes pixels at or above minAlpha opaque and clears the rest, in place on ARGB32 scanlines
+  void alphaThresholdRow(uchar* line, int width, int minAlpha)
+  {
+    QRgb* pixels = (QRgb*)line;
+    int x = 0;
+#ifdef SP_HAVE_SSE2
+    const __m128i limit = _mm_set1_epi32(minAlpha - 1);
+    const __m128i opaque = _mm_set1_epi32(int(0xff000000));
+    for(; x + 16 <= width; x += 16)
+    {
+      for(int i = 0; i < 16; i += 4)
+      {
+        const __m128i pixel = _mm_loadu_si128((const __m128i*)(pixels + x + i));
+        const __m128i keep = _mm_cmpgt_epi32(_mm_srli_epi32(pixel, 24), limit);
+        _mm_storeu_si128((__m128i*)(pixels + x + i), _mm_and_si128(keep, _mm_or_si128(pixel, opaque)));
+      }
+    }
+#endif
+    for(; x < width; ++x)
+      pixels[x] = qAlpha(pixels[x]) >= minAlpha ? pixels[x] | 0xff000000 : 0;
+  }
+
+#ifdef SP_HAVE_AVX2
+  SP_TARGET_AVX2 void alphaThresholdRowAVX2(uchar* line, int width, int minAlpha)
+  {
+    QRgb* pixels = (QRgb*)line;
+    const __m256i limit = _mm256_set1_epi32(minAlpha - 1);
+    const __m256i opaque = _mm256_set1_epi32(int(0xff000000));
+    int x = 0;
+    for(; x + 32 <= width; x += 32)
+    {
+      for(int i = 0; i < 32; i += 8)
+      {
+        const __m256i pixel = _mm256_loadu_si256((const __m256i*)(pixels + x + i));
+        const __m256i keep = _mm256_cmpgt_epi32(_mm256_srli_epi32(pixel, 24), limit);
+        _mm256_storeu_si256((__m256i*)(pixels + x + i), _mm256_and_si256(keep, _mm256_or_si256(pixel, opaque)));
+      }
+    }
+    alphaThresholdRow(line + x * 4, width - x, minAlpha);
+  }
+#endif
+}
+
+QImage AlphaThreshold(const QImage& input, float threshold)
+{
+  return AlphaThreshold(QImage(input), threshold);
+}
+
+QImage AlphaThreshold(QImage&& input, float threshold)
+{
+  // An ARGB32 image that nothing else references is thresholded without a copy
+  QImage retVal(std::move(input));
+  if(retVal.format() != QImage::Format_ARGB32)
+    retVal = retVal.convertToFormat(QImage::Format_ARGB32);
+
+  const int minAlpha = alphaThresholdByte(threshold);
+#ifdef SP_HAVE_AVX2
+  const bool useAVX2 = CpuHasAVX2();
+#endif
+  uchar* bits = retVal.bits();
+  const int bytesPerLine = retVal.bytesPerLine();
+  ParallelFor(retVal.height(), AlphaThresholdRowsPerChunk, [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      uchar* line = bits + y * bytesPerLine;
+#ifdef SP_HAVE_AVX2
+      if(useAVX2)
+      {
+        alphaThresholdRowAVX2(line, retVal.width(), minAlpha);
+        continue;
+      }
+#endif
+      alphaThresholdRow(line, retVal.width(), minAlpha);
+    }
+  });
+  return retVal;
+}
+
+namespace
+{
+  float getLuminance(QRgb val)
+  {
+    return 0.2126 * (qRed(val)/255.0) + 0.7152 * (qGreen(val)/255.0) + 0.0722 * (qBlue(val)/255.0);
+  }
+
+  // Percentiles come from a luminance histogram, which keeps memory constant
+  const int LuminanceBins = 4096;
+
+  int luminanceBin(float luminance)
+  {
+    return qBound(0, int(luminance * LuminanceBins), LuminanceBins - 1);
+  }
+
+  // The value at the given rank of the sorted luminances, assuming the values
+  // in its bin are spread evenly across the bin
+  float luminanceAtRank(const QVector<qint64>& histogram, qint64 rank)
+  {
+    qint64 below = 0;
+    for(int bin = 0; bin < LuminanceBins; ++bin)
+    {
+      if(rank < below + histogram[bin])
+        return (bin + (rank - below + 0.5f) / histogram[bin]) / LuminanceBins;
+      below += histogram[bin];
+    }
+    return 1.0f;
+  }
+
+  template<typename T>
+  T interpolateLinear(T start, T end, float factor)
+  {
+    return start + (end - start) * factor;
+  };
+
+  template<typename T>
+  T interpolateLinear(T start, T end, float startT, float endT, float time)
+  {
+    return interpolateLinear(start, end, (time-startT)/(endT-startT));
+  };
+
+
+  float applyMapping(float value, float start, float mid, float end, float midp=0.5f)
+  {
+    if(value < start)
+      return 0.0f;
+    if(value > end)
+      return 1.0f;
+
+    if(value < mid)
+      return interpolateLinear(0.0f, midp, start, mid, value);
+    else
+      return interpolateLinear(midp, 1.0f, mid, end, value);
+  }
+
+  float barycentricInterpolation(float px, float py, float x1, float y1, float v1, float x2, float y2, float v2, float x3, float y3, float v3)
+  {
+    float div = ((y2-y3)*(x1-x3) + (x3-x2)*(y1-y3));
+    float w1 = ((y2-y3)*(px-x3) + (x3-x2)*(py-y3)) / div;
+    float w2 = ((y3-y1)*(px-x3) + (x1-x3)*(py-y3)) / div;
+    float w3 = 1 - w1 - w2;
+    return v1*w1 + v2*w2 + v3*w3;
+  }
+
+  const int NormalizeRowsPerChunk = 8;
+
+  // Port of the QColor calls that replaced a pixel's lightness: setRgba(), convertTo(Hsl),
+  // setHsl(hue(), hslSaturation(), lightness) and convertTo(Rgb). It keeps QColor's 16-bit
+  // channels and does the same double arithmetic in the same order, so the bytes match.
+  const int QColorMax = 65535;
+  const int QColorAchromatic = 65535;
+
+  int qtDiv257(int x)
+  {
+    return (x - (x >> 8) + 0x80) >> 8;
+  }
+
+  // qRound() for the values that occur here, which are never negative enough to matter
+  int roundPositive(double d)
+  {
+    return int(d + 0.5);
+  }
+
+  // Hue in hundredths of a degree of a colour with delta > 0, shared by toHsl() and toHsv()
+  int hueCentidegrees(double r, double g, double b, double max, double delta)
+  {
+    double hue;
+    if(r == max)
+      hue = (g - b) / delta;
+    else if(g == max)
+      hue = 2.0 + (b - r) / delta;
+    else
+      hue = 4.0 + (r - g) / delta;
+    hue *= 60.0;
+    if(hue < 0.0)
+      hue += 360.0;
+    return roundPositive(hue * 100);
+  }
+
+  // QColor::toHsl()
+  void rgbToHsl(const int* rgb, int& hue, int& saturation, int& lightness)
+  {
+    const double r = rgb[0] / double(QColorMax);
+    const double g = rgb[1] / double(QColorMax);
+    const double b = rgb[2] / double(QColorMax);
+    const double max = qMax(qMax(r, g), b);
+    const double min = qMin(qMin(r, g), b);
+    const double delta = max - min;
+    const double delta2 = max + min;
+    const double light = 0.5 * delta2;
+    lightness = roundPositive(light * QColorMax);
+    if(delta == 0.0)
+    {
+      hue = QColorAchromatic;
+      saturation = 0;
+      return;
+    }
+    if(light < 0.5)
+      saturation = roundPositive((delta / delta2) * QColorMax);
+    else
+      saturation = roundPositive((delta / (2.0 - delta2)) * QColorMax);
+    hue = hueCentidegrees(r, g, b, max, delta);
+  }
+
+  // QColor::hue(), the HSV hue in degrees or -1
+  int hsvHue(const int* rgb)
+  {
+    const double r = rgb[0] / double(QColorMax);
+    const double g = rgb[1] / double(QColorMax);
+    const double b = rgb[2] / double(QColorMax);
+    const double max = qMax(qMax(r, g), b);
+    const double min = qMin(qMin(r, g), b);
+    const double delta = max - min;
+    if(delta == 0.0)
+      return -1;
+    return hueCentidegrees(r, g, b, max, delta) / 100;
+  }
+
+  // QColor::toRgb() of an HSL colour
+  void hslToRgb(int hue, int saturation, int lightness, int* rgb)
+  {
+    if(saturation == 0 || hue == QColorAchromatic)
+    {
+      rgb[0] = rgb[1] = rgb[2] = lightness;
+      return;
+    }
+    if(lightness == 0)
+    {
+      rgb[0] = rgb[1] = rgb[2] = 0;
+      return;
+    }
+
+    const double h = hue == 36000 ? 0 : hue / 36000.;
+    const double s = saturation / double(QColorMax);
+    const double l = lightness / double(QColorMax);
+    const double temp2 = l < 0.5 ? l * (1.0 + s) : l + s - (l * s);
+    const double temp1 = (2.0 * l) - temp2;
+    const double temp3[3] = {h + (1.0 / 3.0), h, h - (1.0 / 3.0)};
+
+    for(int i = 0; i < 3; ++i)
+    {
+      double t = temp3[i];
+      if(t < 0.0)
+        t += 1.0;
+      else if(t > 1.0)
+        t -= 1.0;
+
+      const double sixT = t * 6.0;
+      int value;
+      if(sixT < 1.0)
+        value = roundPositive((temp1 + (temp2 - temp1) * sixT) * QColorMax);
+      else if((t * 2.0) < 1.0)
+        value = roundPositive(temp2 * QColorMax);
+      else if((t * 3.0) < 2.0)
+        value = roundPositive((temp1 + (temp2 - temp1) * (2.0 / 3.0 - t) * 6.0) * QColorMax);
+      else
+        value = roundPositive(temp1 * QColorMax);
+      rgb[i] = value == 1 ? 0 : value;
+    }
+  }
+
+  // QColor::hue() and QColor::hslSaturation() of a pixel converted to HSL. hue() takes the
+  // HSL colour back to RGB and from there to HSV.
+  void hslHueSaturation(QRgb pixel, int& hue, int& saturation)
+  {
+    const int rgb[3] = {qRed(pixel) * 0x101, qGreen(pixel) * 0x101, qBlue(pixel) * 0x101};
+    int hslHue, hslSaturation, lightness;
+    rgbToHsl(rgb, hslHue, hslSaturation, lightness);
+
+    int roundTrip[3];
+    hslToRgb(hslHue, hslSaturation, lightness, roundTrip);
+    hue = hsvHue(roundTrip);
+    saturation = qtDiv257(hslSaturation);
+  }
+
+  // QColor::setHsl() followed by red(), green() and blue()
+  void hslToRgbBytes(int hue, int saturation, int lightness, int* out)
+  {
+    int rgb[3];
+    hslToRgb(hue == -1 ? QColorAchromatic : (hue % 360) * 100, saturation * 0x101, lightness * 0x101, rgb);
+    for(int i = 0; i < 3; ++i)
+      out[i] = qtDiv257(rgb[i]);
+  }
+
+  // The pixel's red, green and blue bytes with its HSL lightness replaced
+  void replaceLightness(QRgb pixel, int lightness, int* out)
+  {
+    int hue, saturation;
+    hslHueSaturation(pixel, hue, saturation);
+    hslToRgbBytes(hue, saturation, lightness, out);
+  }
+
+  // Maps each pixel's luminance through the black, mid and white points and makes it the new
+  // lightness. Red is written to byte 0 and blue to byte 2, as the QColor version did.
+  void normalizeRow(uchar* line, int begin, int end, float minL, float medianL, float maxL)
+  {
+    for(int x = begin; x < end; ++x)
+    {
+      const QRgb pixel = ((const QRgb*)line)[x];
+      float luminance = getLuminance(pixel);
+      float normalized = applyMapping(luminance, minL, medianL, maxL);
+      uchar byteV = normalized*255;
+      int rgb[3];
+      replaceLightness(pixel, byteV, rgb);
+      line[x*4+0] = rgb[0];
+      line[x*4+1] = rgb[1];
+      line[x*4+2] = rgb[2];
+    }
+  }
+
+#ifdef SP_HAVE_AVX2
+  // The same conversions on 4 pixels at a time. Branches become blends, every lane takes
+  // the operations of its scalar branch, and without FMA the results are bit-identical.
+  SP_TARGET_AVX2 inline __m128i roundPositiveAVX2(__m256d d)
+  {
+    return _mm256_cvttpd_epi32(_mm256_add_pd(d, _mm256_set1_pd(0.5)));
+  }
+
+  SP_TARGET_AVX2 inline __m128i qtDiv257AVX2(__m128i x)
+  {
+    return _mm_srli_epi32(_mm_add_epi32(_mm_sub_epi32(x, _mm_srli_epi32(x, 8)), _mm_set1_epi32(0x80)), 8);
+  }
+
+  SP_TARGET_AVX2 inline __m256d toUnitAVX2(__m128i x)
+  {
+    return _mm256_div_pd(_mm256_cvtepi32_pd(x), _mm256_set1_pd(QColorMax));
+  }
+
+  SP_TARGET_AVX2 inline __m128i hueCentidegreesAVX2(__m256d r, __m256d g, __m256d b, __m256d max, __m256d delta)
+  {
+    const __m256d hueR = _mm256_div_pd(_mm256_sub_pd(g, b), delta);
+    const __m256d hueG = _mm256_add_pd(_mm256_set1_pd(2.0), _mm256_div_pd(_mm256_sub_pd(b, r), delta));
+    const __m256d hueB = _mm256_add_pd(_mm256_set1_pd(4.0), _mm256_div_pd(_mm256_sub_pd(r, g), delta));
+    __m256d hue = _mm256_blendv_pd(_mm256_blendv_pd(hueB, hueG, _mm256_cmp_pd(g, max, _CMP_EQ_OQ)),
+                                   hueR, _mm256_cmp_pd(r, max, _CMP_EQ_OQ));
+    hue = _mm256_mul_pd(hue, _mm256_set1_pd(60.0));
+    hue = _mm256_blendv_pd(hue, _mm256_add_pd(hue, _mm256_set1_pd(360.0)), _mm256_cmp_pd(hue, _mm256_setzero_pd(), _CMP_LT_OQ));
+    return roundPositiveAVX2(_mm256_mul_pd(hue, _mm256_set1_pd(100.0)));
+  }
+
+  SP_TARGET_AVX2 inline void rgbToHslAVX2(const __m128i* rgb, __m128i& hue, __m128i& saturation, __m128i& lightness)
+  {
+    const __m256d r = toUnitAVX2(rgb[0]);
+    const __m256d g = toUnitAVX2(rgb[1]);
+    const __m256d b = toUnitAVX2(rgb[2]);
+    const __m256d max = _mm256_max_pd(_mm256_max_pd(r, g), b);
+    const __m256d min = _mm256_min_pd(_mm256_min_pd(r, g), b);
+    const __m256d delta = _mm256_sub_pd(max, min);
+    const __m256d delta2 = _mm256_add_pd(max, min);
+    const __m256d light = _mm256_mul_pd(_mm256_set1_pd(0.5), delta2);
+    lightness = roundPositiveAVX2(_mm256_mul_pd(light, _mm256_set1_pd(QColorMax)));
+
+    const __m256d dark = _mm256_cmp_pd(light, _mm256_set1_pd(0.5), _CMP_LT_OQ);
+    const __m256d ratio = _mm256_blendv_pd(_mm256_div_pd(delta, _mm256_sub_pd(_mm256_set1_pd(2.0), delta2)),
+                                           _mm256_div_pd(delta, delta2), dark);
+    const __m128i grey = _mm256_cvtpd_epi32(_mm256_and_pd(_mm256_cmp_pd(delta, _mm256_setzero_pd(), _CMP_EQ_OQ), _mm256_set1_pd(-1.0)));
+    saturation = _mm_andnot_si128(grey, roundPositiveAVX2(_mm256_mul_pd(ratio, _mm256_set1_pd(QColorMax))));
+    hue = _mm_blendv_epi8(hueCentidegreesAVX2(r, g, b, max, delta), _mm_set1_epi32(QColorAchromatic), grey);
+  }
+
+  SP_TARGET_AVX2 inline __m128i hsvHueAVX2(const __m128i* rgb)
+  {
+    const __m256d r = toUnitAVX2(rgb[0]);
+    const __m256d g = toUnitAVX2(rgb[1]);
+    const __m256d b = toUnitAVX2(rgb[2]);
+    const __m256d max = _mm256_max_pd(_mm256_max_pd(r, g), b);
+    const __m256d min = _mm256_min_pd(_mm256_min_pd(r, g), b);
+    const __m256d delta = _mm256_sub_pd(max, min);
+    const __m128i grey = _mm256_cvtpd_epi32(_mm256_and_pd(_mm256_cmp_pd(delta, _mm256_setzero_pd(), _CMP_EQ_OQ), _mm256_set1_pd(-1.0)));
+    // Integer division by 100 of hundredths of a degree, exact through doubles
+    const __m128i degrees = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(hueCentidegreesAVX2(r, g, b, max, delta)), _mm256_set1_pd(100.0)));
+    return _mm_blendv_epi8(degrees, _mm_set1_epi32(-1), grey);
+  }
+
+  SP_TARGET_AVX2 inline void hslToRgbAVX2(__m128i hue, __m128i saturation, __m128i lightness, __m128i* rgb)
+  {
+    const __m128i grey = _mm_or_si128(_mm_cmpeq_epi32(saturation, _mm_setzero_si128()), _mm_cmpeq_epi32(hue, _mm_set1_epi32(QColorAchromatic)));
+    const __m128i black = _mm_cmpeq_epi32(lightness, _mm_setzero_si128());
+
+    const __m256d fullCircle = _mm256_cvtepi32_pd(_mm_cmpeq_epi32(hue, _mm_set1_epi32(36000)));
+    const __m256d h = _mm256_blendv_pd(_mm256_div_pd(_mm256_cvtepi32_pd(hue), _mm256_set1_pd(36000.)), _mm256_setzero_pd(), fullCircle);
+    const __m256d s = toUnitAVX2(saturation);
+    const __m256d l = toUnitAVX2(lightness);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d temp2 = _mm256_blendv_pd(_mm256_sub_pd(_mm256_add_pd(l, s), _mm256_mul_pd(l, s)),
+                                           _mm256_mul_pd(l, _mm256_add_pd(one, s)),
+                                           _mm256_cmp_pd(l, _mm256_set1_pd(0.5), _CMP_LT_OQ));
+    const __m256d temp1 = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), l), temp2);
+    const __m256d span = _mm256_sub_pd(temp2, temp1);
+    const __m256d temp3[3] = {_mm256_add_pd(h, _mm256_set1_pd(1.0 / 3.0)), h, _mm256_sub_pd(h, _mm256_set1_pd(1.0 / 3.0))};
+
+    for(int i = 0; i < 3; ++i)
+    {
+      __m256d t = temp3[i];
+      const __m256d below = _mm256_cmp_pd(t, _mm256_setzero_pd(), _CMP_LT_OQ);
+      const __m256d above = _mm256_cmp_pd(t, one, _CMP_GT_OQ);
+      t = _mm256_blendv_pd(_mm256_blendv_pd(t, _mm256_sub_pd(t, one), above), _mm256_add_pd(t, one), below);
+
+      const __m256d sixT = _mm256_mul_pd(t, _mm256_set1_pd(6.0));
+      const __m256d rising = _mm256_add_pd(temp1, _mm256_mul_pd(span, sixT));
+      const __m256d falling = _mm256_add_pd(temp1, _mm256_mul_pd(_mm256_mul_pd(span, _mm256_sub_pd(_mm256_set1_pd(2.0 / 3.0), t)), _mm256_set1_pd(6.0)));
+      __m256d value = _mm256_blendv_pd(temp1, falling, _mm256_cmp_pd(_mm256_mul_pd(t, _mm256_set1_pd(3.0)), _mm256_set1_pd(2.0), _CMP_LT_OQ));
+      value = _mm256_blendv_pd(value, temp2, _mm256_cmp_pd(_mm256_mul_pd(t, _mm256_set1_pd(2.0)), one, _CMP_LT_OQ));
+      value = _mm256_blendv_pd(value, rising, _mm256_cmp_pd(sixT, one, _CMP_LT_OQ));
+
+      __m128i channel = roundPositiveAVX2(_mm256_mul_pd(value, _mm256_set1_pd(QColorMax)));
+      channel = _mm_andnot_si128(_mm_cmpeq_epi32(channel, _mm_set1_epi32(1)), channel);
+      channel = _mm_andnot_si128(black, channel);
+      rgb[i] = _mm_blendv_epi8(channel, lightness, grey);
+    }
+  }
+
+  SP_TARGET_AVX2 inline void hslHueSaturationAVX2(const __m128i* rgb, __m128i& hue, __m128i& saturation)
+  {
+    __m128i hslHue, hslSaturation, lightness;
+    rgbToHslAVX2(rgb, hslHue, hslSaturation, lightness);
+
+    __m128i roundTrip[3];
+    hslToRgbAVX2(hslHue, hslSaturation, lightness, roundTrip);
+    hue = hsvHueAVX2(roundTrip);
+    saturation = qtDiv257AVX2(hslSaturation);
+  }
+
+  SP_TARGET_AVX2 void normalizeRowAVX2(uchar* line, int begin, int end, float minL, float medianL, float maxL)
+  {
+    int x = begin;
+    for(; x + 4 <= end; x += 4)
+    {
+      alignas(16) int channels[3][4];
+      alignas(16) int lightness[4];
+      for(int i = 0; i < 4; ++i)
+      {
+        const QRgb pixel = ((const QRgb*)line)[x + i];
+        float luminance = getLuminance(pixel);
+        float normalized = applyMapping(luminance, minL, medianL, maxL);
+        uchar byteV = normalized*255;
+        lightness[i] = byteV;
+        channels[0][i] = qRed(pixel) * 0x101;
+        channels[1][i] = qGreen(pixel) * 0x101;
+        channels[2][i] = qBlue(pixel) * 0x101;
+      }
+
+      const __m128i rgb[3] = {_mm_load_si128((const __m128i*)channels[0]),
+                              _mm_load_si128((const __m128i*)channels[1]),
+                              _mm_load_si128((const __m128i*)channels[2])};
+      __m128i degrees, saturation;
+      hslHueSaturationAVX2(rgb, degrees, saturation);
+      const __m128i wrapped = _mm_andnot_si128(_mm_cmpeq_epi32(degrees, _mm_set1_epi32(360)), degrees);
+      const __m128i newHue = _mm_blendv_epi8(_mm_mullo_epi32(wrapped, _mm_set1_epi32(100)), _mm_set1_epi32(QColorAchromatic),
+                                             _mm_cmpeq_epi32(degrees, _mm_set1_epi32(-1)));
+      const __m128i newSaturation = _mm_mullo_epi32(saturation, _mm_set1_epi32(0x101));
+      const __m128i newLightness = _mm_mullo_epi32(_mm_load_si128((const __m128i*)lightness), _mm_set1_epi32(0x101));
+
+      __m128i result[3];
+      hslToRgbAVX2(newHue, newSaturation, newLightness, result);
+      for(int c = 0; c < 3; ++c)
+        _mm_store_si128((__m128i*)channels[c], qtDiv257AVX2(result[c]));
+      for(int i = 0; i < 4; ++i)
+      {
+        line[(x+i)*4+0] = channels[0][i];
+        line[(x+i)*4+1] = channels[1][i];
+        line[(x+i)*4+2] = channels[2][i];
+      }
+    }
+    normalizeRow(line, x, end, minL, medianL, maxL);
+  }
+#endif
+
+  const int PosterizeRowsPerChunk = 8;
+  const int PointwiseRowsPerChunk = 8;
+
+  // Everything Posterize can output for one pair of step sizes. Palette row 0 is grey, row
+  // 1 + hue / stepSizeH is that hue step at saturation 40. Rows hold one colour per lightness,
+  // packed as red | green << 8 | blue << 16 in the byte order Posterize writes.
+  struct PosterizePalette
+  {
+    QVector<int> lightness;
+    QVector<int> hueRows;
+    QVector<quint32> colours;
+  };
+
+  PosterizePalette posterizePalette(int stepSizeL, int stepSizeH)
+  {
+    PosterizePalette palette;
+    palette.lightness.resize(256);
+    for(int l = 0; l < 256; ++l)
+      palette.lightness[l] = l/stepSizeL*stepSizeL;
+
+    // Indexed by QColor::hue() + 1; a quantized hue of -1 stays achromatic
+    palette.hueRows.resize(361);
+    for(int hue = -1; hue < 360; ++hue)
+      palette.hueRows[hue + 1] = hue/stepSizeH*stepSizeH == -1 ? 0 : 1 + hue/stepSizeH;
+
+    const int rows = 2 + 359/stepSizeH;
+    palette.colours.resize(rows * 256);
+    for(int row = 0; row < rows; ++row)
+    {
+      for(int l = 0; l < 256; ++l)
+      {
+        int rgb[3];
+        if(row == 0)
+          hslToRgbBytes(-1, 0, l, rgb);
+        else
+          hslToRgbBytes((row - 1) * stepSizeH, 40, l, rgb);
+        palette.colours[row * 256 + l] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16);
+      }
+    }
+    return palette;
+  }
+
+  // Index of the pixel's colour in palette.colours
+  int posterizeCode(const uchar* pixel, const PosterizePalette& palette)
+  {
+    const int lightness = palette.lightness[qMax(qMax(pixel[0], pixel[1]), pixel[2])];
+    int hue, saturation;
+    hslHueSaturation(*(const QRgb*)pixel, hue, saturation);
+    const int row = saturation < 20 ? 0 : palette.hueRows[hue + 1];
+    return row * 256 + lightness;
+  }
+
+  void posterizeRow(uchar* line, int begin, int end, const PosterizePalette& palette)
+  {
+    for(int x = begin; x < end; ++x)
+    {
+      const quint32 colour = palette.colours[posterizeCode(line + x*4, palette)];
+      line[x*4+0] = colour;
+      line[x*4+1] = colour >> 8;
+      line[x*4+2] = colour >> 16;
+    }
+  }
+
+  // Writes the colour table index of every pixel, transparent pixels get their own entry
+  void posterizeIndexRow(const uchar* line, uchar* out, int begin, int end, const PosterizePalette& palette,
+                         const int* indices, int transparent)
+  {
+    for(int x = begin; x < end; ++x)
+      out[x] = line[x*4+3] == 0 ? transparent : indices[posterizeCode(line + x*4, palette)];
+  }
+
+#ifdef SP_HAVE_AVX2
+  SP_TARGET_AVX2 inline __m128i posterizeCodeAVX2(__m128i pixels, const PosterizePalette& palette)
+  {
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128i blue = _mm_and_si128(pixels, byteMask);
+    const __m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask);
+    const __m128i red = _mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask);
+    const __m128i maxChannel = _mm_max_epi32(_mm_max_epi32(red, green), blue);
+    const __m128i lightness = _mm_i32gather_epi32(palette.lightness.constData(), maxChannel, 4);
+
+    const __m128i rgb[3] = {_mm_mullo_epi32(red, _mm_set1_epi32(0x101)),
+                            _mm_mullo_epi32(green, _mm_set1_epi32(0x101)),
+                            _mm_mullo_epi32(blue, _mm_set1_epi32(0x101))};
+    __m128i hue, saturation;
+    hslHueSaturationAVX2(rgb, hue, saturation);
+    __m128i row = _mm_i32gather_epi32(palette.hueRows.constData(), _mm_add_epi32(hue, _mm_set1_epi32(1)), 4);
+    row = _mm_andnot_si128(_mm_cmplt_epi32(saturation, _mm_set1_epi32(20)), row);
+    return _mm_add_epi32(_mm_slli_epi32(row, 8), lightness);
+  }
+
+  SP_TARGET_AVX2 void posterizeRowAVX2(uchar* line, int begin, int end, const PosterizePalette& palette)
+  {
+    int x = begin;
+    for(; x + 4 <= end; x += 4)
+    {
+      const __m128i pixels = _mm_loadu_si128((const __m128i*)(line + x*4));
+      const __m128i code = posterizeCodeAVX2(pixels, palette);
+      const __m128i colours = _mm_i32gather_epi32((const int*)palette.colours.constData(), code, 4);
+      const __m128i alpha = _mm_andnot_si128(_mm_set1_epi32(0x00ffffff), pixels);
+      _mm_storeu_si128((__m128i*)(line + x*4), _mm_or_si128(alpha, colours));
+    }
+    posterizeRow(line, x, end, palette);
+  }
+
+  SP_TARGET_AVX2 void posterizeIndexRowAVX2(const uchar* line, uchar* out, int begin, int end, const PosterizePalette& palette,
+                                            const int* indices, int transparent)
+  {
+    int x = begin;
+    for(; x + 4 <= end; x += 4)
+    {
+      const __m128i pixels = _mm_loadu_si128((const __m128i*)(line + x*4));
+      __m128i index = _mm_i32gather_epi32(indices, posterizeCodeAVX2(pixels, palette), 4);
+      const __m128i clear = _mm_cmpeq_epi32(_mm_srli_epi32(pixels, 24), _mm_setzero_si128());
+      index = _mm_blendv_epi8(index, _mm_set1_epi32(transparent), clear);
+      index = _mm_packus_epi16(_mm_packs_epi32(index, index), index);
+      *(int*)(out + x) = _mm_cvtsi128_si32(index);
+    }
+    posterizeIndexRow(line, out, x, end, palette, indices, transparent);
+  }
+#endif
+
+  // True if every alpha of an ARGB32 image is 0 or 255
+  bool hasBinaryAlpha(const QImage& image, bool* hasTransparent)
+  {
+    *hasTransparent = false;
+    const int w = image.width();
+    for(int y = 0; y < image.height(); ++y)
+    {
+      const uchar* line = image.constScanLine(y);
+      int x = 0;
+#ifdef SP_HAVE_SSE2
+      __m128i binary = _mm_set1_epi32(-1);
+      __m128i clear = _mm_setzero_si128();
+      for(; x + 4 <= w; x += 4)
+      {
+        const __m128i alpha = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(line + x * 4)), 24);
+        const __m128i zero = _mm_cmpeq_epi32(alpha, _mm_setzero_si128());
+        binary = _mm_and_si128(binary, _mm_or_si128(zero, _mm_cmpeq_epi32(alpha, _mm_set1_epi32(255))));
+        clear = _mm_or_si128(clear, zero);
+      }
+      if(_mm_movemask_epi8(binary) != 0xffff)
+        return false;
+      if(_mm_movemask_epi8(clear) != 0)
+        *hasTransparent = true;
+#endif
+      for(; x < w; ++x)
+      {
+        const uchar alpha = line[x * 4 + 3];
+        if(alpha != 0 && alpha != 255)
+          return false;
+        if(alpha == 0)
+          *hasTransparent = true;
+      }
+    }
+    return true;
+  }
+}
+
+namespace
+{
+  // Luminances at the black, mid and white point ranks of the pixels with alpha above 64,
+  // read from an ARGB32 image
+  void luminancePercentiles(const QImage& image, float blackPoint, float midPoint, float whitePoint,
+                            float& minL, float& medianL, float& maxL)
+  {
+    const int height = image.height();
+
+    // One partial histogram per worker over its own band of rows, merged afterwards
+    const int partials = qMax(1, qMin(height, WorkerThreads()->maxThreadCount()));
+    QVector<QVector<qint64>> partialHistograms(partials, QVector<qint64>(LuminanceBins, 0));
+    QVector<qint64> partialCounts(partials, 0);
+    ParallelFor(partials, 1, [&](int begin, int end)
+    {
+      for(int part = begin; part < end; ++part)
+      {
+        qint64* histogram = partialHistograms[part].data();
+        qint64 count = 0;
+        for(int y = height * part / partials; y < height * (part + 1) / partials; ++y)
+        {
+          const QRgb* line = (const QRgb*)image.constScanLine(y);
+          for(int x = 0; x < image.width(); ++x)
+          {
+            const QRgb& pixel = line[x];
+            if(qAlpha(pixel) > 64)
+            {
+              histogram[luminanceBin(getLuminance(pixel))]++;
+              count++;
+            }
+          }
+        }
+        partialCounts[part] = count;
+      }
+    });
+
+    QVector<qint64> histogram(partialHistograms[0]);
+    qint64 count = partialCounts[0];
+    for(int part = 1; part < partials; ++part)
+    {
+      const qint64* partial = partialHistograms[part].constData();
+      for(int bin = 0; bin < LuminanceBins; ++bin)
+        histogram[bin] += partial[bin];
+      count += partialCounts[part];
+    }
+
+    // Without visible pixels the mapping stays linear
+    minL = 0.0f;
+    medianL = 0.5f;
+    maxL = 1.0f;
+    if(count > 0)
+    {
+      minL = luminanceAtRank(histogram, qMin<qint64>(count*blackPoint, count-1));
+      medianL = luminanceAtRank(histogram, qMin<qint64>(count*midPoint, count-1));
+      maxL = luminanceAtRank(histogram, qMin<qint64>((count-1)*whitePoint, count-1));
+    }
+  }
+}
+
+QImage NormalizedGrayscale(const QImage& input, float blackPoint, float midPoint, float whitePoint)
+{
+  QImage retVal(input.convertToFormat(QImage::Format_ARGB32));
+  const int height = retVal.height();
+  float minL, medianL, maxL;
+  luminancePercentiles(retVal, blackPoint, midPoint, whitePoint, minL, medianL, maxL);
+
+#ifdef SP_HAVE_AVX2
+  const bool useAVX2 = CpuHasAVX2();
+#endif
+  // Non-const access detaches once here, not from the worker threads
+  uchar* bits = retVal.bits();
+  const int bytesPerLine = retVal.bytesPerLine();
+  ParallelFor(height, NormalizeRowsPerChunk, [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      uchar* line = bits + y * bytesPerLine;
+#ifdef SP_HAVE_AVX2
+      if(useAVX2)
+      {
+        normalizeRowAVX2(line, 0, retVal.width(), minL, medianL, maxL);
+        continue;
+      }
+#endif
+      normalizeRow(line, 0, retVal.width(), minL, medianL, maxL);
+    }
+  });
+  return retVal;
+}
+
+QImage Posterize(const QImage& input, int stepsL, int stepsH)
+{
+  int stepSizeL = 255 / stepsL;
+  int stepSizeH = 255 / stepsH;
+  QImage retVal(input.convertToFormat(QImage::Format_ARGB32));
+  const PosterizePalette palette = posterizePalette(stepSizeL, stepSizeH);
+
+#ifdef SP_HAVE_AVX2
+  const bool useAVX2 = CpuHasAVX2();
+#endif
+  uchar* bits = retVal.bits();
+  const int bytesPerLine = retVal.bytesPerLine();
+  ParallelFor(retVal.height(), PosterizeRowsPerChunk, [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      uchar* line = bits + y * bytesPerLine;
+#ifdef SP_HAVE_AVX2
+      if(useAVX2)
+      {
+        posterizeRowAVX2(line, 0, retVal.width(), palette);
+        continue;
+      }
+#endif
+      posterizeRow(line, 0, retVal.width(), palette);
+    }
+  });
+  return retVal;
+}
+
+QImage PosterizeIndexed(const QImage& input, int stepsL, int stepsH)
+{
+  int stepSizeL = 255 / stepsL;
+  int stepSizeH = 255 / stepsH;
+  const QImage source(input.convertToFormat(QImage::Format_ARGB32));
+  const PosterizePalette palette = posterizePalette(stepSizeL, stepSizeH);
+
+  // Every colour the quantizer can produce, once, as the QRgb an ARGB32 result would hold
+  QVector<QRgb> colourTable;
+  QVector<int> indices(palette.colours.size(), 0);
+  QHash<quint32, int> tableIndex;
+  for(int row = 0; row < palette.colours.size() / 256; ++row)
+  {
+    for(int l = 0; l < 256; l += stepSizeL)
+    {
+      const int code = row * 256 + l;
+      const quint32 colour = palette.colours[code];
+      if(!tableIndex.contains(colour))
+      {
+        tableIndex.insert(colour, colourTable.size());
+        colourTable.append(0xff000000 | colour);
+      }
+      indices[code] = tableIndex.value(colour);
+    }
+  }
+
+  bool hasTransparent;
+  if(colourTable.size() > 255 || !hasBinaryAlpha(source, &hasTransparent))
+    return Posterize(source, stepsL, stepsH);
+  const int transparent = colourTable.size();
+  if(hasTransparent)
+    colourTable.append(qRgba(0, 0, 0, 0));
+
+  QImage retVal(source.width(), source.height(), QImage::Format_Indexed8);
+  retVal.setColorTable(colourTable);
+#ifdef SP_HAVE_AVX2
+  const bool useAVX2 = CpuHasAVX2();
+#endif
+  uchar* bits = retVal.bits();
+  const int bytesPerLine = retVal.bytesPerLine();
+  ParallelFor(source.height(), PosterizeRowsPerChunk, [&](int begin, int end)
+  {
+    for(int y = begin; y < end; ++y)
+    {
+      const uchar* line = source.constScanLine(y);
+      uchar* out = bits + y * bytesPerLine;
+#ifdef SP_HAVE_AVX2
+      if(useAVX2)
+      {
+        posterizeIndexRowAVX2(line, out, 0, source.width(), palette, indices.constData(), transparent);
+        continue;
+      }
+#endif
+      posterizeIndexRow(line, out, 0, source.width(), palette, indices.constData(), transparent);
+    }
+  });
+  return retVal;
+}
+
+namespace
+{
+  // Normalization and posterize, the stages that only look at a pixel's colour
+  struct ColourStages
+  {
+    bool normalize = false;
+    float minL = 0.0f;
+    float medianL = 0.5f;
+    float maxL = 1.0f;
+    bool posterize = false;
+    PosterizePalette palette;
+    bool useAVX2 = false;
+
+    void run(uchar* line, int width) const
+    {
+#ifdef SP_HAVE_AVX2
+      if(useAVX2)
+      {
+        if(normalize)
+          normalizeRowAVX2(line, 0, width, minL, medianL, maxL);
+        if(posterize)
+          posterizeRowAVX2(line, 0, width, palette);
+        return;
+      }
+#endif
+      if(normalize)
+        normalizeRow(line, 0, width, minL, medianL, maxL);
+      if(posterize)
+        posterizeRow(line, 0, width, palette);
+    }
+  };
+
+  // What the colour stages make of each RGB value, filled in as colours turn up. The blues of
+  // each red and green share a block of 256 entries allocated on first use. Entries are 0
+  // until computed, then hold the colour with Filled set.
+  class ColourLut
+  {
+  public:
+    static const quint32 Filled = 0x01000000;
+
+    ColourLut() = default;
+    ColourLut(const ColourLut&) = delete;
+    ColourLut& operator=(const ColourLut&) = delete;
+    ~ColourLut()
+    {
+      for(const QAtomicPointer<QAtomicInteger<quint32>>& block : blocks)
+        delete[] block.loadAcquire();
+    }
+
+    quint32 find(QRgb pixel) const
+    {
+      const QAtomicInteger<quint32>* block = blocks[(pixel >> 8) & 0xffff].loadAcquire();
+      return block ? block[pixel & 0xff].loadAcquire() : 0;
+    }
+
+    // Threads that race on a colour all store the same value
+    void insert(QRgb pixel, QRgb colour)
+    {
+      QAtomicPointer<QAtomicInteger<quint32>>& slot = blocks[(pixel >> 8) & 0xffff];
+      QAtomicInteger<quint32>* block = slot.loadAcquire();
+      if(!block)
+      {
+        QAtomicInteger<quint32>* fresh = new QAtomicInteger<quint32>[256];
+        if(slot.testAndSetOrdered(nullptr, fresh))
+          block = fresh;
+        else
+        {
+          delete[] fresh;
+          block = slot.loadAcquire();
+        }
+      }
+      block[pixel & 0xff].storeRelease((colour & 0xffffff) | Filled);
+    }
+
+  private:
+    QAtomicPointer<QAtomicInteger<quint32>> blocks[65536];
+  };
+
+  // Everything the colour stages' output depends on. Normalization depends on the image
+  // through its percentiles, so only images with the same ones share a table.
+  struct ColourLutKey
+  {
+    bool normalize = false;
+    float minL = 0.0f;
+    float medianL = 0.0f;
+    float maxL = 0.0f;
+    bool posterize = false;
+    int stepSizeL = 0;
+    int stepSizeH = 0;
+
+    bool operator==(const ColourLutKey& other) const
+    {
+      return normalize == other.normalize && minL == other.minL && medianL == other.medianL && maxL == other.maxL &&
+             posterize == other.posterize && stepSizeL == other.stepSizeL && stepSizeH == other.stepSizeH;
+    }
+  };
+
+  // The table for the last settings, so a batch or preview updates that keep them reuse the
+  // colours already computed
+  QSharedPointer<ColourLut> colourLut(const ColourLutKey& key)
+  {
+    static QMutex mutex;
+    static ColourLutKey cachedKey;
+    static QSharedPointer<ColourLut> cached;
+
+    QMutexLocker lock(&mutex);
+    if(!cached || !(cachedKey == key))
+    {
+      cached.reset(new ColourLut);
+      cachedKey = key;
+    }
+    return cached;
+  }
+
+  // Replaces the colours of a row through the table. The ones it has not seen yet go through
+  // the stage kernels together and are added. Alpha is left alone. Returns the number of misses.
+  int colourLutRow(QRgb* line, int width, const ColourStages& stages, ColourLut& lut,
+                   QVector<QRgb>& missed, QVector<int>& missedAt)
+  {
+    missed.clear();
+    missedAt.clear();
+    for(int x = 0; x < width; ++x)
+    {
+      const quint32 colour = lut.find(line[x]);
+      if(colour)
+        line[x] = (line[x] & 0xff000000) | (colour & 0xffffff);
+      else
+      {
+        missed.append(line[x]);
+        missedAt.append(x);
+      }
+    }
+    if(missed.isEmpty())
+      return 0;
+
+    QVector<QRgb> computed(missed);
+    stages.run((uchar*)computed.data(), computed.size());
+    for(int i = 0; i < missed.size(); ++i)
+    {
+      line[missedAt[i]] = (missed[i] & 0xff000000) | (computed[i] & 0xffffff);
+      lut.insert(missed[i], computed[i]);
+    }
+    return missed.size();
+  }
+
+  // When more than half of the first this many pixels miss the table, the rest of the image
+  // goes through the stage kernels: a fresh table on resampled output with many distinct
+  // colours costs more than it saves. A table that passes keeps filling, so images that
+  // share it can warm it up.
+  const qint64 ColourLutSamplePixels = 65536;
+}
+
+QImage ApplyPointwise(const QImage& input, const PointwiseStages& stages)
+{
+  return ApplyPointwise(QImage(input), stages);
+}
+
+QImage ApplyPointwise(QImage&& input, const PointwiseStages& stages)
+{
+  if(!stages.normalize && !stages.alphaThreshold && !stages.posterize)
+    return std::move(input);
+
+  QImage retVal(std::move(input));
+  if(retVal.format() != QImage::Format_ARGB32)
+    retVal = retVal.convertToFormat(QImage::Format_ARGB32);
+
+  // Normalization needs statistics of the whole image before any pixel changes
+  ColourStages colourStages;
+  colourStages.normalize = stages.normalize;
+  if(stages.normalize)
+    luminancePercentiles(retVal, stages.blackPoint, stages.midPoint, stages.whitePoint,
+                         colourStages.minL, colourStages.medianL, colourStages.maxL);
+  colourStages.posterize = stages.posterize;
+  if(stages.posterize)
+    colourStages.palette = posterizePalette(255 / stages.stepsL, 255 / stages.stepsH);
+#ifdef SP_HAVE_AVX2
+  colourStages.useAVX2 = CpuHasAVX2();
+#endif
+  const int minAlpha = alphaThresholdByte(stages.threshold);
+
+  QSharedPointer<ColourLut> lut;
+  if(stages.normalize || stages.posterize)
+  {
+    ColourLutKey key;
+    key.normalize = stages.normalize;
+    if(stages.normalize)
+    {
+      key.minL = colourStages.minL;
+      key.medianL = colourStages.medianL;
+      key.maxL = colourStages.maxL;
+    }
+    key.posterize = stages.posterize;
+    if(stages.posterize)
+    {
+      key.stepSizeL = 255 / stages.stepsL;
+      key.stepSizeH = 255 / stages.stepsH;
+    }
+    lut = colourLut(key);
+  }
+
+  // Each row goes through every stage while it is still in cache. The threshold can run after
+  // posterize because the pixels it clears posterize to 0 anyway.
+  const int width = retVal.width();
+  uchar* bits = retVal.bits();
+  const int bytesPerLine = retVal.bytesPerLine();
+  QAtomicInteger<qint64> lookups(0);
+  QAtomicInteger<qint64> misses(0);
+  QAtomicInt bypassLut(0);
+  ParallelFor(retVal.height(), PointwiseRowsPerChunk, [&](int begin, int end)
+  {
+    QVector<QRgb> missed;
+    QVector<int> missedAt;
+    for(int y = begin; y < end; ++y)
+    {
+      uchar* line = bits + y * bytesPerLine;
+      if(lut && bypassLut.loadAcquire())
+        colourStages.run(line, width);
+      else if(lut)
+      {
+        const int rowMisses = colourLutRow((QRgb*)line, width, colourStages, *lut, missed, missedAt);
+        const qint64 missedSoFar = misses.fetchAndAddOrdered(rowMisses) + rowMisses;
+        const qint64 looked = lookups.fetchAndAddOrdered(width) + width;
+        if(looked - width < ColourLutSamplePixels && looked >= ColourLutSamplePixels && missedSoFar * 2 > looked)
+          bypassLut.storeRelease(1);
+      }
+      if(stages.alphaThreshold)
+      {
+#ifdef SP_HAVE_AVX2
+        if(colourStages.useAVX2)
+        {
+          alphaThresholdRowAVX2(line, width, minAlpha);
+          continue;
+        }
+#endif
+        alphaThresholdRow(line, width, minAlpha);
+      }
+    }
+  });
   return retVal;
 }
@@ -2,9 +2,66 @@
 
 #include <QImage>
 
-QImage ScaleAVIR(const QImage& input, float factor);
+struct ResizerCacheStats
+{
+  int hits = 0;
+  int misses = 0;
+};
+
+// AVIR filter presets, from fastest to sharpest
+enum class AvirQuality
+{
+  Low,
+  Default,
+  LR,
+  High,
+  Ultra
+};
+
+QImage ScaleAVIR(const QImage& input, float factor, AvirQuality quality = AvirQuality::LR, int buildMode = -1);
+// Whether ScaleAVIR without a build mode takes its exact 1/N downscale instead of AVIR
+bool AvirFastPathApplies(float factor, AvirQuality quality);
+ResizerCacheStats AvirCacheStats();
+int AvirBuildModeCount(AvirQuality quality);
+// Times each build mode on this resize and returns the fastest one whose output stays
+// within tolerance levels of the automatic choice, or -1 if none does
+int AutotuneAvirBuildMode(const QImage& input, float factor, AvirQuality quality, int tolerance = 1);
 QImage ScaleBilinear(const QImage& input, float factor);
 QImage ScaleDPID(const QImage& input, int pixelFactor, float sharpeningCurve = 0.5f);
+// Each output pixel covers pixelFactor source pixels along both axes; it can be fractional
+QImage ScaleDPID(const QImage& input, const QImage& reference, float pixelFactor, float sharpeningCurve = 0.5f);
+// Downscales to size, whose ratios to the input size can be fractional and differ between
+// the axes. The guide is an AVIR resize to size unless a reference of that size is given.
+QImage ScaleDPID(const QImage& input, const QSize& size, float sharpeningCurve = 0.5f);
+QImage ScaleDPID(const QImage& input, const QSize& size, const QImage& reference, float sharpeningCurve = 0.5f);
+// Cheaper DPID guide than ScaleAVIR: box averages of the source, lightly smoothed
+QImage DpidBoxGuide(const QImage& input, const QSize& size);
+float ComposedScaleFactor(int width, int height, int maxInputSize, int downscaleFactor);
 QImage AlphaThreshold(const QImage& input, float threshold);
+// Works in place when input is an ARGB32 image with no other references
+QImage AlphaThreshold(QImage&& input, float threshold);
 QImage NormalizedGrayscale(const QImage& input, float blackPoint=0.0f, float midPoint=0.5f, float whitePoint=1.0f);
 QImage Posterize(const QImage& input, int stepsL, int stepsH);
+// Posterize into a Format_Indexed8 image with one colour table entry per colour, plus one
+// for fully transparent pixels. Falls back to Posterize's ARGB32 output when some alpha is
+// neither 0 nor 255 or the steps allow more than 255 colours.
+QImage PosterizeIndexed(const QImage& input, int stepsL, int stepsH);
+
+// Settings of the per-pixel stages ApplyPointwise chains, in the order they run
+struct PointwiseStages
+{
+  bool normalize = false;
+  float blackPoint = 0.0f;
+  float midPoint = 0.5f;
+  float whitePoint = 1.0f;
+  bool alphaThreshold = false;
+  float threshold = 0.5f;
+  bool posterize = false;
+  int stepsL = 8;
+  int stepsH = 8;
+};
+
+// NormalizedGrayscale, AlphaThreshold and Posterize with the same result as calling them in
+// turn, but in one pass over a single ARGB32 buffer after reading the luminance statistics
+QImage ApplyPointwise(const QImage& input, const PointwiseStages& stages);
+QImage ApplyPointwise(QImage&& input, const PointwiseStages& stages);
@@ -1,7 +1,60 @@
 #include "mainwindow.h"
 #include <QApplication>
 #include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QThread>
+#include <limits>
+#include "avirtuning.h"
+#ifdef SP_SELF_TEST
+#include "dpidselftest.h"
+#endif
 #include "filters.h"
+#include "pipeline.h"
+#include "threadpool.h"
+
+namespace
+{
+  const int BenchmarkRuns = 5;
+
+  // Fastest of BenchmarkRuns calls, in milliseconds
+  double bestTime(const std::function<void()>& run)
+  {
+    qint64 best = std::numeric_limits<qint64>::max();
+    for(int i = 0; i < BenchmarkRuns; ++i)
+    {
+      QElapsedTimer timer;
+      timer.start();
+      run();
+      best = qMin(best, timer.nsecsElapsed());
+    }
+    return best / 1e6;
+  }
+
+  // Times the normalize stage and the whole pipeline on each file with 1, 2, 4... worker
+  // threads, up to one per core
+  void benchmark(const Pipeline& pipeline, const QStringList& files)
+  {
+    QVector<int> threadCounts;
+    for(int threads = 1; threads < QThread::idealThreadCount(); threads *= 2)
+      threadCounts.append(threads);
+    threadCounts.append(QThread::idealThreadCount());
+
+    for(const QString& file : files)
+    {
+      const QImage image(file);
+      for(int threads : threadCounts)
+      {
+        SetWorkerThreadCount(threads);
+        const double normalize = bestTime([&]() { NormalizedGrayscale(image); });
+        const double total = bestTime([&]() { pipeline.run(image); });
+        qWarning("%s, worker threads %d: normalize %.1f ms, pipeline %.1f ms", qPrintable(file), threads, normalize, total);
+      }
+    }
+
+    const ResizerCacheStats cacheStats = AvirCacheStats();
+    qWarning("AVIR resizer cache: %d hits, %d misses", cacheStats.hits, cacheStats.misses);
+  }
+}
 
 int main(int argc, char *argv[])
 {
@@ -9,11 +62,36 @@ int main(int argc, char *argv[])
 
   QCommandLineParser parser;
   parser.addOption({{"b", "batch"}, "Batch processing mode"});
-  parser.addOption({{"a", "alpha-threshold"}, "Alpha threshold"});
+  parser.addOption({{"a", "alpha-threshold"}, "Alpha threshold", "threshold"});
+  parser.addOption({{"d", "downscale"}, "Downscale by 1/<factor>", "factor"});
+  parser.addOption({{"m", "scaling-method"}, "Downscale method: AVIR, DPID or Bilinear", "method", "AVIR"});
+  parser.addOption({"sharpening-curve", "DPID sharpening exponent", "exponent", "0.5"});
+  parser.addOption({"dpid-guide", "DPID guide image: AVIR or Box", "guide", "AVIR"});
+  parser.addOption({"max-input-size", "Limit the long side of the input, folded into the downscale", "px"});
+  parser.addOption({"avir-quality", "AVIR preset: Low, Default, LR, High or Ultra", "preset", "LR"});
+  parser.addOption({{"j", "threads"}, "Worker threads in batch mode, 0 for one per core", "count", "0"});
+  parser.addOption({{"p", "posterize"}, "Posterize to <luminance>,<hue> steps", "steps"});
+  parser.addOption({"indexed", "Write posterized images with a color table when they fit in 256 colors"});
+  parser.addOption({"preset", "Run the stages of a pipeline preset instead of the options above", "file"});
+  parser.addOption({"save-preset", "Write the pipeline the options describe to a preset file", "file"});
+  parser.addOption({"autotune", "Time the AVIR build modes for untuned sizes and remember the fastest"});
+  parser.addOption({"benchmark", "Time the normalize stage and the pipeline on the files at 1 to N threads instead of saving them"});
+#ifdef SP_SELF_TEST
+  parser.addOption({"self-test", "Check the optimized DPID kernels against their reference and exit"});
+#endif
   parser.addPositionalArgument("files", "The files to process", "[files...]");
   parser.addHelpOption();
   parser.process(a);
 
+#ifdef SP_SELF_TEST
+  if(parser.isSet("self-test"))
+  {
+    const int difference = DpidKernelSelfTest();
+    qWarning("DPID kernels: largest difference %d", difference);
+    return difference > 1 ? 1 : 0;
+  }
+#endif
+
   if(!parser.optionNames().contains("batch"))
   {
     MainWindow w;
@@ -22,17 +100,93 @@ int main(int argc, char *argv[])
   }
   else
   {
-    bool doAlphaThreshold = parser.optionNames().contains("alpha-threshold");
-    float alphaThreshold = parser.value("alpha-threshold").toFloat();
+    SetWorkerThreadCount(parser.value("threads").toInt());
+
+    Pipeline pipeline;
+    if(parser.isSet("preset"))
+    {
+      QString error;
+      if(!LoadPipelinePreset(parser.value("preset"), &pipeline, &error))
+      {
+        qWarning("%s", qPrintable(error));
+        return 1;
+      }
+    }
+    else
+    {
+      int maxInputSize = parser.value("max-input-size").toInt();
+      if(maxInputSize > 0)
+      {
+        PipelineStage limit;
+        limit.type = PipelineStage::Limit;
+        limit.maxInputSize = maxInputSize;
+        pipeline.stages.append(limit);
+      }
+
+      int downscaleFactor = qMax(1, parser.value("downscale").toInt());
+      if(downscaleFactor > 1)
+      {
+        PipelineStage scale;
+        scale.type = PipelineStage::Scale;
+        scale.downscaleFactor = downscaleFactor;
+        scale.sharpeningCurve = parser.value("sharpening-curve").toFloat();
+        if(!ParseScalingMethod(parser.value("scaling-method"), &scale.method))
+        {
+          qWarning("Unknown scaling method %s", qPrintable(parser.value("scaling-method")));
+          return 1;
+        }
+        if(!ParseAvirQuality(parser.value("avir-quality"), &scale.avirQuality))
+        {
+          qWarning("Unknown AVIR quality preset %s", qPrintable(parser.value("avir-quality")));
+          return 1;
+        }
+        if(!ParseDpidGuide(parser.value("dpid-guide"), &scale.dpidGuide))
+        {
+          qWarning("Unknown DPID guide %s", qPrintable(parser.value("dpid-guide")));
+          return 1;
+        }
+        pipeline.stages.append(scale);
+      }
+
+      if(parser.optionNames().contains("alpha-threshold"))
+      {
+        PipelineStage alphaThreshold;
+        alphaThreshold.type = PipelineStage::AlphaThreshold;
+        alphaThreshold.threshold = parser.value("alpha-threshold").toFloat();
+        pipeline.stages.append(alphaThreshold);
+      }
+
+      if(parser.isSet("posterize"))
+      {
+        QStringList steps = parser.value("posterize").split(',');
+        PipelineStage posterize;
+        posterize.type = PipelineStage::Posterize;
+        posterize.stepsL = qBound(1, steps.value(0).toInt(), 255);
+        posterize.stepsH = qBound(1, steps.value(1, steps.value(0)).toInt(), 255);
+        posterize.indexed = parser.isSet("indexed");
+        pipeline.stages.append(posterize);
+      }
+    }
+    if(parser.isSet("autotune"))
+      pipeline.autotune = true;
+
+    if(parser.isSet("save-preset"))
+    {
+      if(!SavePipelinePreset(pipeline, parser.value("save-preset")))
+      {
+        qWarning("Cannot write %s", qPrintable(parser.value("save-preset")));
+        return 1;
+      }
+    }
 
     QStringList files = parser.positionalArguments();
-    for(const QString& file: files)
+    if(parser.isSet("benchmark"))
     {
-      QImage image(file);
-      if(doAlphaThreshold)
-        image = AlphaThreshold(image, alphaThreshold);
-      image.save(file);
+      benchmark(pipeline, files);
+      return 0;
     }
+    for(const QString& file: files)
+      pipeline.run(QImage(file)).save(file);
 
     return 0;
   }
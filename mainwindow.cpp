@@ -8,8 +8,11 @@
 #include <QtDebug>
 #include <QDropEvent>
 #include <QMimeData>
+#include <QMessageBox>
 
 #include "filters.h"
+#include "pipeline.h"
+#include "threadpool.h"
 
 MainWindow::MainWindow(QWidget *parent) :
   QMainWindow(parent),
@@ -18,6 +21,7 @@ MainWindow::MainWindow(QWidget *parent) :
   ui->setupUi(this);
   scene = new QGraphicsScene(this);
   ui->preview->setScene(scene);
+  stageCache = new PipelineCache();
 
   this->settingsChanged();
 }
@@ -27,6 +31,7 @@ MainWindow::~MainWindow()
   delete scene;
   delete ui;
   delete srcImg;
+  delete stageCache;
 }
 
 void MainWindow::settingsChanged()
@@ -37,54 +42,19 @@ void MainWindow::settingsChanged()
   int stepsLuminance = ui->input_LuminanceSteps->value();
   int stepsMaterial  = ui->input_MaterialSteps->value();
   int scaleFactor    = ui->input_DownscaleFactor->value();
-  int maxInputSize   = ui->input_MaxInputSize->value();
-  float alphaThreshold = ui->input_AlphaThreshold->value()/100.0;
+  int threadCount    = ui->input_Threads->value();
 
-  float blackPoint   = ui->input_BlackPoint->value();
-  float grayMidpoint = ui->input_GrayPoint->value();
-  float whitePoint   = ui->input_WhitePoint->value();
-
-  float sharpeningCurve = ui->input_SharpeningCurve->value();
-
-  bool applyAlphaThreshold = ui->settings_AlphaThreshold->isChecked();
-  bool applyScaling        = ui->settings_Downscale->isChecked();
-  bool applyGrayscale      = ui->settings_NormalizeLuminance->isChecked();
-  bool applyPosterize      = ui->settings_Posterize->isChecked();
-  bool limitInput          = ui->settings_LimitInputSize->isChecked();
-
-  if(!applyScaling)
+  if(!ui->settings_Downscale->isChecked())
     scaleFactor = 1;
 
-  QString scalingMethod = ui->input_ScalingMethod->currentText();
+  SetWorkerThreadCount(threadCount);
+  stageCache->setBudget(ui->input_CacheBudget->value() * 1024LL * 1024);
 
   ui->label_TotalColors->setText(QString::number(stepsMaterial*stepsLuminance));
 
-  QImage img;
   if(srcImg)
   {
-    img = *srcImg;
-    int longSide = qMax(srcImg->width(), srcImg->height());
-
-    if(limitInput && longSide > maxInputSize)
-    {
-      float factor = (float(maxInputSize)/float(longSide));
-      img = ScaleBilinear(img, factor);
-    }
-    if(applyScaling)
-    {
-      if(scalingMethod=="AVIR")
-        img = ScaleAVIR(img, 1.0 / scaleFactor);
-      else if(scalingMethod=="DPID")
-        img = ScaleDPID(img, scaleFactor, sharpeningCurve);
-      else if(scalingMethod=="Bilinear")
-        img = ScaleBilinear(img, 1.0 / scaleFactor);
-    }
-    if(applyGrayscale)
-      img = NormalizedGrayscale(img, blackPoint, grayMidpoint, whitePoint);
-    if(applyAlphaThreshold)
-      img = AlphaThreshold(img, alphaThreshold);
-    if(applyPosterize)
-      img = Posterize(img, stepsLuminance, stepsMaterial);
+    QImage img = currentPipeline().run(*srcImg, stageCache);
 
     scene->clear();
     QGraphicsPixmapItem* pixmap = scene->addPixmap(QPixmap::fromImage(img));
@@ -95,6 +65,127 @@ void MainWindow::settingsChanged()
   }
 }
 
+Pipeline MainWindow::currentPipeline() const
+{
+  Pipeline pipeline;
+
+  // The input limit and the downscale are done in one resample from the source
+  if(ui->settings_LimitInputSize->isChecked())
+  {
+    PipelineStage limit;
+    limit.type = PipelineStage::Limit;
+    limit.maxInputSize = ui->input_MaxInputSize->value();
+    pipeline.stages.append(limit);
+  }
+  if(ui->settings_Downscale->isChecked())
+  {
+    PipelineStage scale;
+    scale.type = PipelineStage::Scale;
+    scale.downscaleFactor = ui->input_DownscaleFactor->value();
+    scale.method = ScalingMethod(ui->input_ScalingMethod->currentIndex());
+    scale.avirQuality = AvirQuality(ui->input_AvirQuality->currentIndex());
+    scale.dpidGuide = DpidGuide(ui->input_DpidGuide->currentIndex());
+    scale.sharpeningCurve = ui->input_SharpeningCurve->value();
+    pipeline.stages.append(scale);
+  }
+  if(ui->settings_NormalizeLuminance->isChecked())
+  {
+    PipelineStage normalize;
+    normalize.type = PipelineStage::Normalize;
+    normalize.blackPoint = ui->input_BlackPoint->value();
+    normalize.midPoint = ui->input_GrayPoint->value();
+    normalize.whitePoint = ui->input_WhitePoint->value();
+    pipeline.stages.append(normalize);
+  }
+  if(ui->settings_AlphaThreshold->isChecked())
+  {
+    PipelineStage alphaThreshold;
+    alphaThreshold.type = PipelineStage::AlphaThreshold;
+    alphaThreshold.threshold = ui->input_AlphaThreshold->value()/100.0;
+    pipeline.stages.append(alphaThreshold);
+  }
+  if(ui->settings_Posterize->isChecked())
+  {
+    PipelineStage posterize;
+    posterize.type = PipelineStage::Posterize;
+    posterize.stepsL = ui->input_LuminanceSteps->value();
+    posterize.stepsH = ui->input_MaterialSteps->value();
+    posterize.indexed = ui->input_IndexedColors->isChecked();
+    pipeline.stages.append(posterize);
+  }
+  return pipeline;
+}
+
+void MainWindow::showPipeline(const Pipeline& pipeline)
+{
+  // The window has a fixed order, so stages are matched to the controls by type
+  blockSlots = true;
+  ui->settings_LimitInputSize->setChecked(false);
+  ui->settings_Downscale->setChecked(false);
+  ui->settings_NormalizeLuminance->setChecked(false);
+  ui->settings_AlphaThreshold->setChecked(false);
+  ui->settings_Posterize->setChecked(false);
+  for(const PipelineStage& stage : pipeline.stages)
+  {
+    switch(stage.type)
+    {
+    case PipelineStage::Limit:
+      ui->settings_LimitInputSize->setChecked(true);
+      ui->input_MaxInputSize->setValue(stage.maxInputSize);
+      break;
+    case PipelineStage::Scale:
+      ui->settings_Downscale->setChecked(true);
+      ui->input_DownscaleFactor->setValue(stage.downscaleFactor);
+      ui->input_ScalingMethod->setCurrentIndex(int(stage.method));
+      ui->input_AvirQuality->setCurrentIndex(int(stage.avirQuality));
+      ui->input_DpidGuide->setCurrentIndex(int(stage.dpidGuide));
+      ui->input_SharpeningCurve->setValue(stage.sharpeningCurve);
+      break;
+    case PipelineStage::Normalize:
+      ui->settings_NormalizeLuminance->setChecked(true);
+      ui->input_BlackPoint->setValue(stage.blackPoint);
+      ui->input_GrayPoint->setValue(stage.midPoint);
+      ui->input_WhitePoint->setValue(stage.whitePoint);
+      break;
+    case PipelineStage::AlphaThreshold:
+      ui->settings_AlphaThreshold->setChecked(true);
+      ui->input_AlphaThreshold->setValue(qRound(stage.threshold*100));
+      break;
+    case PipelineStage::Posterize:
+      ui->settings_Posterize->setChecked(true);
+      ui->input_LuminanceSteps->setValue(stage.stepsL);
+      ui->input_MaterialSteps->setValue(stage.stepsH);
+      ui->input_IndexedColors->setChecked(stage.indexed);
+      break;
+    }
+  }
+  blockSlots = false;
+  settingsChanged();
+}
+
+void MainWindow::savePresetAction()
+{
+  QString fileName = QFileDialog::getSaveFileName(this, tr("Save Preset"), "", tr("Presets (*.json)"));
+
+  if(!fileName.isEmpty() && !SavePipelinePreset(currentPipeline(), fileName))
+    QMessageBox::warning(this, tr("Save Preset"), tr("Cannot write %1").arg(fileName));
+}
+
+void MainWindow::loadPresetAction()
+{
+  QString fileName = QFileDialog::getOpenFileName(this, tr("Load Preset"), "", tr("Presets (*.json)"));
+
+  if(!fileName.isEmpty())
+  {
+    Pipeline pipeline;
+    QString error;
+    if(LoadPipelinePreset(fileName, &pipeline, &error))
+      showPipeline(pipeline);
+    else
+      QMessageBox::warning(this, tr("Load Preset"), error);
+  }
+}
+
 void MainWindow::saveImageAction()
 {
 
@@ -109,6 +200,7 @@ void MainWindow::loadImageAction()
     if(srcImg)
         delete srcImg;
     srcImg = new QImage(fileName);
+    stageCache->clear();
     settingsChanged();
   }
 }
@@ -126,6 +218,7 @@ void MainWindow::dropEvent(QDropEvent* event)
     if(srcImg)
         delete srcImg;
     srcImg = new QImage(fileName.toLocalFile());
+    stageCache->clear();
     settingsChanged();
   }
 
@@ -9,11 +9,8 @@ class MainWindow;
 
 class QGraphicsScene;
 class QImage;
-
-namespace avir
-{
-  struct CImageResizerParams;
-};
+class Pipeline;
+class PipelineCache;
 
 class MainWindow : public QMainWindow
 {
@@ -27,16 +24,22 @@ public slots:
   void settingsChanged();
   void saveImageAction();
   void loadImageAction();
+  void savePresetAction();
+  void loadPresetAction();
 
 protected:
   void dragEnterEvent(QDragEnterEvent *event);
   void dropEvent(QDropEvent* event);
 
 private:
+  // The filter stages the controls describe, and the reverse
+  Pipeline currentPipeline() const;
+  void showPipeline(const Pipeline& pipeline);
+
   Ui::MainWindow *ui = nullptr;
   QGraphicsScene *scene = nullptr;
   QImage *srcImg = nullptr;
-  avir::CImageResizerParams *avirParams;
+  PipelineCache *stageCache = nullptr;
   bool blockSlots = false;
 };
 
@@ -0,0 +1,363 @@
+#include "pipeline.h"
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include "avirtuning.h"
+
+namespace
+{
+  const char* const StageNames[] = {"limit", "scale", "normalize", "alphaThreshold", "posterize"};
+  const char* const MethodNames[] = {"AVIR", "DPID", "Bilinear"};
+  const char* const GuideNames[] = {"AVIR", "Box"};
+
+  // Position of name in names, ignoring case, or -1
+  int nameIndex(const QString& name, const char* const* names, int count)
+  {
+    for(int i = 0; i < count; ++i)
+      if(name.compare(names[i], Qt::CaseInsensitive) == 0)
+        return i;
+    return -1;
+  }
+
+  qint64 imageBytes(const QImage& image)
+  {
+    return qint64(image.bytesPerLine()) * image.height();
+  }
+
+  bool fail(QString* error, const QString& message)
+  {
+    if(error)
+      *error = message;
+    return false;
+  }
+
+  // Stages ApplyPointwise can run; it takes them in the order of their types
+  bool isPointwise(const PipelineStage& stage)
+  {
+    return stage.type == PipelineStage::Normalize || stage.type == PipelineStage::AlphaThreshold ||
+           (stage.type == PipelineStage::Posterize && !stage.indexed);
+  }
+
+  // ScaleAVIR with the tuned build mode, tuning it first when asked to. Resizes that take
+  // the fast path don't go through AVIR, so they have nothing to tune.
+  QImage scaleAvirTuned(const QImage& image, float factor, AvirQuality quality, bool autotune)
+  {
+    if(AvirFastPathApplies(factor, quality))
+      return ScaleAVIR(image, factor, quality);
+
+    int buildMode = TunedAvirBuildMode(image.size(), factor, quality);
+    if(autotune && buildMode < 0)
+    {
+      buildMode = AutotuneAvirBuildMode(image, factor, quality);
+      SaveTunedAvirBuildMode(image.size(), factor, quality, buildMode);
+    }
+    return ScaleAVIR(image, factor, quality, buildMode);
+  }
+
+  // Downscales by scale's factor after limiting the long side to maxInputSize, in one resample
+  QImage resample(const QImage& image, int maxInputSize, const PipelineStage& scale, bool autotune)
+  {
+    const float limitFactor = ComposedScaleFactor(image.width(), image.height(), maxInputSize, 1);
+    const float factor = ComposedScaleFactor(image.width(), image.height(), maxInputSize, scale.downscaleFactor);
+    if(scale.method == ScalingMethod::Bilinear)
+      return ScaleBilinear(image, factor);
+    if(scale.method == ScalingMethod::DPID)
+    {
+      // Both the guide and the kernel read the source. Under an input limit the footprints are
+      // fractional and sized per axis, so that they cover the source exactly.
+      QImage reference;
+      if(scale.dpidGuide == DpidGuide::Box)
+        reference = DpidBoxGuide(image, QSize(image.width()*factor, image.height()*factor));
+      else
+        reference = scaleAvirTuned(image, factor, scale.avirQuality, autotune);
+      if(limitFactor < 1.0f)
+        return ScaleDPID(image, reference.size(), reference, scale.sharpeningCurve);
+      return ScaleDPID(image, reference, scale.downscaleFactor, scale.sharpeningCurve);
+    }
+    return scaleAvirTuned(image, factor, scale.avirQuality, autotune);
+  }
+
+  QJsonObject stageJson(const PipelineStage& stage)
+  {
+    QJsonObject json;
+    json["type"] = StageNames[stage.type];
+    switch(stage.type)
+    {
+    case PipelineStage::Limit:
+      json["maxInputSize"] = stage.maxInputSize;
+      break;
+    case PipelineStage::Scale:
+      json["downscaleFactor"] = stage.downscaleFactor;
+      json["method"] = ScalingMethodName(stage.method);
+      json["avirQuality"] = AvirQualityName(stage.avirQuality);
+      json["dpidGuide"] = DpidGuideName(stage.dpidGuide);
+      json["sharpeningCurve"] = stage.sharpeningCurve;
+      break;
+    case PipelineStage::Normalize:
+      json["blackPoint"] = stage.blackPoint;
+      json["midPoint"] = stage.midPoint;
+      json["whitePoint"] = stage.whitePoint;
+      break;
+    case PipelineStage::AlphaThreshold:
+      json["threshold"] = stage.threshold;
+      break;
+    case PipelineStage::Posterize:
+      json["luminanceSteps"] = stage.stepsL;
+      json["hueSteps"] = stage.stepsH;
+      json["indexed"] = stage.indexed;
+      break;
+    }
+    return json;
+  }
+
+  // Number of stages from first on that run as one pass: a limit and the scale after it
+  // are one resample, and pointwise stages in ApplyPointwise's order share a pass. With a
+  // cache a normalize is a pass of its own, so tweaking the stages after it doesn't redo
+  // its histogram and remap.
+  int stepLength(const QVector<PipelineStage>& stages, int first, bool cached)
+  {
+    if(stages[first].type == PipelineStage::Limit)
+      return first + 1 < stages.size() && stages[first + 1].type == PipelineStage::Scale ? 2 : 1;
+    if(!isPointwise(stages[first]) || (cached && stages[first].type == PipelineStage::Normalize))
+      return 1;
+    int last = first + 1;
+    while(last < stages.size() && isPointwise(stages[last]) && stages[last].type > stages[last - 1].type)
+      ++last;
+    return last - first;
+  }
+
+  QImage runStep(QImage input, const PipelineStage* step, int count, bool autotune)
+  {
+    const PipelineStage& stage = step[0];
+    if(stage.type == PipelineStage::Limit)
+    {
+      if(count == 2)
+        return resample(input, stage.maxInputSize, step[1], autotune);
+      const float limitFactor = ComposedScaleFactor(input.width(), input.height(), stage.maxInputSize, 1);
+      return limitFactor < 1.0f ? ScaleBilinear(input, limitFactor) : input;
+    }
+    if(stage.type == PipelineStage::Scale)
+      return resample(input, 0, stage, autotune);
+    if(!isPointwise(stage))
+      return PosterizeIndexed(input, stage.stepsL, stage.stepsH);
+
+    PointwiseStages pointwise;
+    for(int i = 0; i < count; ++i)
+    {
+      const PipelineStage& next = step[i];
+      if(next.type == PipelineStage::Normalize)
+      {
+        pointwise.normalize = true;
+        pointwise.blackPoint = next.blackPoint;
+        pointwise.midPoint = next.midPoint;
+        pointwise.whitePoint = next.whitePoint;
+      }
+      else if(next.type == PipelineStage::AlphaThreshold)
+      {
+        pointwise.alphaThreshold = true;
+        pointwise.threshold = next.threshold;
+      }
+      else
+      {
+        pointwise.posterize = true;
+        pointwise.stepsL = next.stepsL;
+        pointwise.stepsH = next.stepsH;
+      }
+    }
+    return ApplyPointwise(std::move(input), pointwise);
+  }
+}
+
+QString ScalingMethodName(ScalingMethod method)
+{
+  return MethodNames[int(method)];
+}
+
+bool ParseScalingMethod(const QString& name, ScalingMethod* method)
+{
+  const int index = nameIndex(name, MethodNames, 3);
+  if(index < 0)
+    return false;
+  *method = ScalingMethod(index);
+  return true;
+}
+
+QString DpidGuideName(DpidGuide guide)
+{
+  return GuideNames[int(guide)];
+}
+
+bool ParseDpidGuide(const QString& name, DpidGuide* guide)
+{
+  const int index = nameIndex(name, GuideNames, 2);
+  if(index < 0)
+    return false;
+  *guide = DpidGuide(index);
+  return true;
+}
+
+PipelineCache::PipelineCache(qint64 budgetBytes) :
+  budget(budgetBytes)
+{
+}
+
+void PipelineCache::setBudget(qint64 budgetBytes)
+{
+  budget = budgetBytes;
+  evict();
+}
+
+void PipelineCache::clear()
+{
+  entries.clear();
+  usedBytes = 0;
+}
+
+bool PipelineCache::find(const QString& key, QImage* image)
+{
+  for(int i = 0; i < entries.size(); ++i)
+  {
+    if(entries[i].key == key)
+    {
+      entries.move(i, 0);
+      *image = entries.first().image;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PipelineCache::insert(const QString& key, const QImage& image)
+{
+  entries.prepend({key, image});
+  usedBytes += imageBytes(image);
+  evict();
+}
+
+void PipelineCache::evict()
+{
+  while(!entries.isEmpty() && usedBytes > budget)
+  {
+    usedBytes -= imageBytes(entries.last().image);
+    entries.removeLast();
+  }
+}
+
+QImage Pipeline::run(const QImage& input, PipelineCache* cache) const
+{
+  // A result's key names the source image and every stage that led to it
+  QImage image(input);
+  QString key = QString::number(input.cacheKey());
+  for(int i = 0; i < stages.size(); )
+  {
+    const int count = stepLength(stages, i, cache != nullptr);
+    if(cache)
+    {
+      QJsonArray step;
+      for(int j = i; j < i + count; ++j)
+        step.append(stageJson(stages[j]));
+      key += "/" + QString::fromUtf8(QJsonDocument(step).toJson(QJsonDocument::Compact));
+      if(cache->find(key, &image))
+      {
+        i += count;
+        continue;
+      }
+    }
+
+    image = runStep(std::move(image), stages.constData() + i, count, autotune);
+    if(cache)
+      cache->insert(key, image);
+    i += count;
+  }
+  return image;
+}
+
+QJsonObject Pipeline::toJson() const
+{
+  QJsonArray stageList;
+  for(const PipelineStage& stage : stages)
+    stageList.append(stageJson(stage));
+
+  QJsonObject json;
+  json["autotune"] = autotune;
+  json["stages"] = stageList;
+  return json;
+}
+
+bool Pipeline::fromJson(const QJsonObject& json, Pipeline* pipeline, QString* error)
+{
+  Pipeline result;
+  result.autotune = json["autotune"].toBool();
+
+  // Parameters a stage leaves out keep their defaults
+  for(const QJsonValue& value : json["stages"].toArray())
+  {
+    const QJsonObject object = value.toObject();
+    PipelineStage stage;
+    const int type = nameIndex(object["type"].toString(), StageNames, 5);
+    if(type < 0)
+      return fail(error, QString("Unknown stage type \"%1\"").arg(object["type"].toString()));
+    stage.type = PipelineStage::Type(type);
+
+    switch(stage.type)
+    {
+    case PipelineStage::Limit:
+      stage.maxInputSize = object["maxInputSize"].toInt(stage.maxInputSize);
+      break;
+    case PipelineStage::Scale:
+      stage.downscaleFactor = object["downscaleFactor"].toInt(stage.downscaleFactor);
+      if(stage.downscaleFactor < 1)
+        return fail(error, "The downscale factor must be at least 1");
+      if(object.contains("method") && !ParseScalingMethod(object["method"].toString(), &stage.method))
+        return fail(error, QString("Unknown scaling method \"%1\"").arg(object["method"].toString()));
+      if(object.contains("avirQuality") && !ParseAvirQuality(object["avirQuality"].toString(), &stage.avirQuality))
+        return fail(error, QString("Unknown AVIR quality preset \"%1\"").arg(object["avirQuality"].toString()));
+      if(object.contains("dpidGuide") && !ParseDpidGuide(object["dpidGuide"].toString(), &stage.dpidGuide))
+        return fail(error, QString("Unknown DPID guide \"%1\"").arg(object["dpidGuide"].toString()));
+      stage.sharpeningCurve = object["sharpeningCurve"].toDouble(stage.sharpeningCurve);
+      break;
+    case PipelineStage::Normalize:
+      stage.blackPoint = object["blackPoint"].toDouble(stage.blackPoint);
+      stage.midPoint = object["midPoint"].toDouble(stage.midPoint);
+      stage.whitePoint = object["whitePoint"].toDouble(stage.whitePoint);
+      break;
+    case PipelineStage::AlphaThreshold:
+      stage.threshold = object["threshold"].toDouble(stage.threshold);
+      break;
+    case PipelineStage::Posterize:
+      stage.stepsL = object["luminanceSteps"].toInt(stage.stepsL);
+      stage.stepsH = object["hueSteps"].toInt(stage.stepsH);
+      if(stage.stepsL < 1 || stage.stepsL > 255 || stage.stepsH < 1 || stage.stepsH > 255)
+        return fail(error, "Posterize steps must be between 1 and 255");
+      stage.indexed = object["indexed"].toBool(stage.indexed);
+      break;
+    }
+    result.stages.append(stage);
+  }
+
+  *pipeline = result;
+  return true;
+}
+
+bool SavePipelinePreset(const Pipeline& pipeline, const QString& fileName)
+{
+  QFile file(fileName);
+  if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    return false;
+  return file.write(QJsonDocument(pipeline.toJson()).toJson()) >= 0;
+}
+
+bool LoadPipelinePreset(const QString& fileName, Pipeline* pipeline, QString* error)
+{
+  QFile file(fileName);
+  if(!file.open(QIODevice::ReadOnly))
+    return fail(error, QString("Cannot open %1").arg(fileName));
+
+  QJsonParseError parseError;
+  const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+  if(parseError.error != QJsonParseError::NoError)
+    return fail(error, QString("%1: %2").arg(fileName, parseError.errorString()));
+  if(!document.isObject())
+    return fail(error, QString("%1 is not a pipeline preset").arg(fileName));
+  return Pipeline::fromJson(document.object(), pipeline, error);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <QImage>
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+#include <QVector>
+#include "filters.h"
+
+enum class ScalingMethod
+{
+  AVIR,
+  DPID,
+  Bilinear
+};
+
+enum class DpidGuide
+{
+  AVIR,
+  Box
+};
+
+QString ScalingMethodName(ScalingMethod method);
+bool ParseScalingMethod(const QString& name, ScalingMethod* method);
+QString DpidGuideName(DpidGuide guide);
+bool ParseDpidGuide(const QString& name, DpidGuide* guide);
+
+// One step of a Pipeline. Only the parameters of its type are used.
+struct PipelineStage
+{
+  enum Type
+  {
+    Limit,
+    Scale,
+    Normalize,
+    AlphaThreshold,
+    Posterize
+  };
+
+  Type type = Scale;
+
+  // Limit: the long side of the image, in pixels
+  int maxInputSize = 0;
+
+  // Scale
+  int downscaleFactor = 1;
+  ScalingMethod method = ScalingMethod::AVIR;
+  AvirQuality avirQuality = AvirQuality::LR;
+  DpidGuide dpidGuide = DpidGuide::AVIR;
+  float sharpeningCurve = 0.5f;
+
+  // Normalize
+  float blackPoint = 0.0f;
+  float midPoint = 0.5f;
+  float whitePoint = 1.0f;
+
+  // AlphaThreshold
+  float threshold = 0.5f;
+
+  // Posterize
+  int stepsL = 8;
+  int stepsH = 8;
+  bool indexed = false;
+};
+
+// Results of pipeline steps from earlier runs. A cached run starts from the result of the
+// last step whose input image and stage parameters, and those of every step before it, are
+// unchanged. The least recently used results are dropped to stay within the budget.
+class PipelineCache
+{
+public:
+  static const qint64 DefaultBudget = 512 * 1024 * 1024;
+
+  explicit PipelineCache(qint64 budgetBytes = DefaultBudget);
+
+  void setBudget(qint64 budgetBytes);
+  void clear();
+
+  bool find(const QString& key, QImage* image);
+  void insert(const QString& key, const QImage& image);
+
+private:
+  struct Entry
+  {
+    QString key;
+    QImage image;
+  };
+
+  void evict();
+
+  // Most recently used first
+  QList<Entry> entries;
+  qint64 budget;
+  qint64 usedBytes = 0;
+};
+
+// The ordered filter stages applied to an image, shared by the GUI and batch mode.
+// A Limit directly followed by a Scale is done in one resample from the source, and
+// consecutive Normalize, AlphaThreshold and Posterize stages in that order share one pass.
+class Pipeline
+{
+public:
+  QVector<PipelineStage> stages;
+  // Time the AVIR build modes of untuned resizes and remember the fastest
+  bool autotune = false;
+
+  // With a cache each pass is cached as one step, so a change to one of its stages
+  // reruns that pass from the cached result of the step before it. The normalized image
+  // is cached on its own, threshold and posterize changes start from it.
+  QImage run(const QImage& input, PipelineCache* cache = nullptr) const;
+
+  QJsonObject toJson() const;
+  // Returns false and describes the problem in error if json is not a valid pipeline
+  static bool fromJson(const QJsonObject& json, Pipeline* pipeline, QString* error = nullptr);
+};
+
+// Presets are pipelines stored as JSON files
+bool SavePipelinePreset(const Pipeline& pipeline, const QString& fileName);
+bool LoadPipelinePreset(const QString& fileName, Pipeline* pipeline, QString* error = nullptr);
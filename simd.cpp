@@ -0,0 +1,11 @@
+#include "simd.h"
+
+bool CpuHasAVX2()
+{
+#if defined(SP_HAVE_AVX2)
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Compile-time availability of SSE2 intrinsics. Every x86-64 target has them.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SP_HAVE_SSE2 1
+#endif
+
+// Functions marked with SP_TARGET_AVX2 may use AVX2 intrinsics without building
+// the whole project for AVX2; call them only after checking CpuHasAVX2().
+#if defined(SP_HAVE_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define SP_HAVE_AVX2 1
+#define SP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Runtime CPU feature check, evaluated once. SSE2 needs none, SP_HAVE_SSE2 builds
+// already require it.
+bool CpuHasAVX2();
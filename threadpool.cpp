@@ -0,0 +1,146 @@
+#include "threadpool.h"
+#include <QAtomicInt>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+
+namespace
+{
+  class WorkloadRunner : public QRunnable
+  {
+  public:
+    WorkloadRunner(avir::CImageResizerThreadPool::CWorkload* workload, QSemaphore* finished)
+      : workload(workload), finished(finished)
+    {
+      setAutoDelete(false);
+    }
+
+    void run() override
+    {
+      workload->process();
+      finished->release();
+    }
+
+  private:
+    avir::CImageResizerThreadPool::CWorkload* workload;
+    QSemaphore* finished;
+  };
+
+  class FunctionRunner : public QRunnable
+  {
+  public:
+    FunctionRunner(const std::function<void()>& function, QSemaphore* finished)
+      : function(function), finished(finished)
+    {
+      setAutoDelete(false);
+    }
+
+    void run() override
+    {
+      function();
+      finished->release();
+    }
+
+  private:
+    std::function<void()> function;
+    QSemaphore* finished;
+  };
+
+  // Idle threads are kept alive so that consecutive resizes don't pay for thread creation.
+  class PersistentThreadPool : public QThreadPool
+  {
+  public:
+    PersistentThreadPool()
+    {
+      setExpiryTimeout(-1);
+    }
+  };
+}
+
+QThreadPool* WorkerThreads()
+{
+  static PersistentThreadPool pool;
+  return &pool;
+}
+
+void SetWorkerThreadCount(int count)
+{
+  WorkerThreads()->setMaxThreadCount(count > 0 ? count : QThread::idealThreadCount());
+}
+
+void ParallelFor(int count, int chunkSize, const std::function<void(int, int)>& body)
+{
+  const int chunks = (count + chunkSize - 1) / chunkSize;
+  const int helpers = qMin(chunks, WorkerThreads()->maxThreadCount()) - 1;
+  if(helpers <= 0)
+  {
+    if(count > 0)
+      body(0, count);
+    return;
+  }
+
+  QAtomicInt nextChunk(0);
+  auto work = [&]()
+  {
+    for(int chunk = nextChunk.fetchAndAddRelaxed(1); chunk < chunks; chunk = nextChunk.fetchAndAddRelaxed(1))
+      body(chunk * chunkSize, qMin(count, (chunk + 1) * chunkSize));
+  };
+
+  QSemaphore finished;
+  QVector<QRunnable*> runners;
+  for(int i = 0; i < helpers; ++i)
+  {
+    runners.push_back(new FunctionRunner(work, &finished));
+    WorkerThreads()->start(runners.last());
+  }
+
+  work();
+
+  // Helpers that never got a thread have nothing left to do, see AvirThreadPool
+  for(QRunnable* runner : runners)
+    if(WorkerThreads()->tryTake(runner))
+      runner->run();
+
+  finished.acquire(helpers);
+  qDeleteAll(runners);
+}
+
+AvirThreadPool::~AvirThreadPool()
+{
+  removeAllWorkloads();
+}
+
+int AvirThreadPool::getSuggestedWorkloadCount() const
+{
+  // The calling thread processes the first workload itself.
+  return qMax(1, WorkerThreads()->maxThreadCount());
+}
+
+void AvirThreadPool::addWorkload(CWorkload* const workload)
+{
+  runners.push_back(new WorkloadRunner(workload, &finished));
+}
+
+void AvirThreadPool::startAllWorkloads()
+{
+  // QThreadPool::start() synchronizes through a mutex, which is the memory barrier AVIR expects here.
+  for(QRunnable* runner : runners)
+    WorkerThreads()->start(runner);
+}
+
+void AvirThreadPool::waitAllWorkloadsToFinish()
+{
+  // Run whatever the pool hasn't picked up yet on this thread. This keeps nested use from a
+  // worker thread from deadlocking and saves a wakeup when all workers are busy.
+  for(QRunnable* runner : runners)
+    if(WorkerThreads()->tryTake(runner))
+      runner->run();
+
+  finished.acquire(runners.size());
+}
+
+void AvirThreadPool::removeAllWorkloads()
+{
+  qDeleteAll(runners);
+  runners.clear();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+#include <QSemaphore>
+#include <QVector>
+#include "avir.h"
+
+class QRunnable;
+class QThreadPool;
+
+// Process-wide pool of persistent worker threads, shared by all filters.
+QThreadPool* WorkerThreads();
+
+// Limits WorkerThreads() to count threads, 0 restores one per core.
+void SetWorkerThreadCount(int count);
+
+// Calls body(begin, end) for consecutive chunks of [0, count). Threads take the next
+// chunk from a shared counter until none are left, the calling thread included, so
+// uneven chunks balance out. Returns when all chunks are done.
+void ParallelFor(int count, int chunkSize, const std::function<void(int, int)>& body);
+
+// Spreads AVIR's scanline workloads over WorkerThreads(). One instance is
+// meant to live for a single resizeImage() call; the threads outlive it.
+class AvirThreadPool : public avir::CImageResizerThreadPool
+{
+public:
+  AvirThreadPool() = default;
+  ~AvirThreadPool();
+
+  int getSuggestedWorkloadCount() const override;
+  void addWorkload(CWorkload* const workload) override;
+  void startAllWorkloads() override;
+  void waitAllWorkloadsToFinish() override;
+  void removeAllWorkloads() override;
+
+private:
+  QVector<QRunnable*> runners;
+  QSemaphore finished;
+};